@@ -51,6 +51,12 @@ struct msg_header {
 #define CMD_GET  0x00
 #define CMD_SET  0x01
 #define CMD_SET_NO_ACK  0x02
+#define CMD_REGISTER  0x03
+#define CMD_GET_BATCH  0x04
+#define CMD_SET_BATCH  0x05
+#define CMD_TRIM  0x06
+#define CMD_FLUSH  0x07
+#define CMD_WRITE_ZEROES  0x08
  
 #define RESP_OK 0x00
 #define RESP_EINVAL 0x04
@@ -60,12 +66,79 @@ struct msg_header {
 #define MAX_EXTRA_LEN 8
 #define MAX_KEY_LEN 8
 
+/*
+ * Flow control: every response carries the connection's current window,
+ * the number of requests (credit_reqs) and 4KB data pages (credit_pages)
+ * the client may have outstanding. A request is outstanding from the
+ * moment its header is sent until its response arrives; a client must
+ * hold back a request that would exceed either limit, except when nothing
+ * is outstanding so a single IO larger than the window still makes
+ * progress. Until the first response, clients assume the REFLEX_INIT_*
+ * window. Both fields are 0 in requests. Requests that carry no data
+ * (CMD_TRIM, CMD_FLUSH, CMD_WRITE_ZEROES) take no pages.
+ */
+#define REFLEX_CREDIT_PAGE_SIZE 4096
+#define REFLEX_INIT_CREDIT_REQS 32
+#define REFLEX_INIT_CREDIT_PAGES 256
+
 typedef struct __attribute__ ((__packed__)) {
   uint16_t magic;
   uint16_t opcode;
   void *req_handle;
   unsigned long lba;
   unsigned int lba_count;
+  uint16_t credit_reqs;
+  uint16_t credit_pages;
 } binary_header_blk_t;
 
+/*
+ * Body of a CMD_REGISTER request, sent right after the header.
+ * Registers the connection with a tenant (flow group) and its SLO;
+ * latency_us_SLO == 0 means best-effort, in which case be_weight sets the
+ * tenant's share of spare throughput relative to other best-effort
+ * tenants (0 is treated as 1). Sending it again on the same
+ * connection moves the connection to the new tenant/SLO. Registering an
+ * existing latency-critical tenant with a different latency-critical SLO
+ * resizes the tenant's reservation for all of its connections.
+ *
+ * The response is a bare header whose lba field carries the result:
+ * 0 on success, -RET_CANTMEETSLO if the SLO can't be admitted (the
+ * tenant then keeps its current SLO) or would switch an existing tenant
+ * between latency-critical and best-effort, -RET_INVAL if
+ * tenant_id has REFLEX_PORT_TENANT_BIT set, or -RET_NOBUFS if the
+ * server's tenant table is full.
+ */
+/* tenant ids with this bit are the server's per-port best-effort defaults */
+#define REFLEX_PORT_TENANT_BIT (1UL << 62)
+
+typedef struct __attribute__ ((__packed__)) {
+  unsigned long tenant_id;
+  unsigned int latency_us_SLO;
+  unsigned long IOPS_SLO;
+  int rw_ratio_SLO;
+  unsigned int be_weight;
+} binary_register_blk_t;
+
+/*
+ * Body of a CMD_GET_BATCH / CMD_SET_BATCH request: header.lba holds the
+ * number of extents (1..REFLEX_MAX_BATCH_EXTENTS) that follow the header
+ * and header.lba_count their total length in sectors. Every extent must be
+ * a whole number of 4KB pages. Write data follows the extents, read data
+ * follows the single response header, both in extent order. The response
+ * is sent once every extent has completed.
+ */
+#define REFLEX_MAX_BATCH_EXTENTS 32
+
+typedef struct __attribute__ ((__packed__)) {
+  unsigned long lba;
+  unsigned int lba_count;
+} binary_extent_blk_t;
 
+/*
+ * CMD_TRIM deallocates and CMD_WRITE_ZEROES zeroes header.lba_count sectors
+ * from header.lba; CMD_FLUSH commits the device's write cache and ignores
+ * both. They are header-only requests with header-only responses, sent
+ * once the device has completed the command. Write zeroes covers at most
+ * 65536 sectors per request.
+ */
+#define REFLEX_MAX_WRITE_ZEROES_SECTORS 65536
@@ -73,6 +73,7 @@
 #include <netinet/in.h>
 
 #define BINARY_HEADER binary_header_blk_t
+#define REGISTER_BODY binary_register_blk_t
 
 #define ROUND_UP(num, multiple) ((((num) + (multiple) - 1) / (multiple)) * (multiple))
 
@@ -113,6 +114,11 @@ static int read_percentage;
 static int SWEEP;
 static bool preconditioning;
 static unsigned long global_target_IOPS = 0;
+static bool register_slo;
+static unsigned int latency_us_SLO;
+static unsigned long IOPS_SLO;
+static int rw_ratio_SLO;
+static unsigned int be_weight = 1;
 
 static __thread struct mempool req_pool;
 static __thread int conn_opened;
@@ -132,6 +138,8 @@ static __thread int tid;
 static __thread long cycles_between_req;
 static __thread unsigned long phase_start;
 static __thread long NUM_MEASURE;
+static __thread REGISTER_BODY tenant_reg;
+static __thread bool reg_waiting;
 
 static struct mempool_datastore nvme_req_buf_datastore;
 static __thread struct mempool nvme_req_buf_pool;
@@ -194,6 +202,10 @@ struct pp_conn {
 	unsigned long seq_count;
 	struct list_head pending_requests;
 	long nvme_fg_handle; 		//nvme flow group handle
+	unsigned int out_reqs;		//sent requests still waiting for a response
+	unsigned int out_pages;
+	unsigned int credit_reqs;	//window last advertised by the server
+	unsigned int credit_pages;
 	char data[4096 + sizeof(BINARY_HEADER)];
 	char data_send[sizeof(BINARY_HEADER)];
 };
@@ -214,6 +226,38 @@ static int parse_ip_addr(const char *str, uint32_t *addr)
 }
 
 
+static inline unsigned int req_pages(struct nvme_req *req)
+{
+	//requests that carry no data take no pages
+	if (req->cmd == CMD_TRIM || req->cmd == CMD_FLUSH ||
+	    req->cmd == CMD_WRITE_ZEROES)
+		return 0;
+	return (req->lba_count * ns_sector_size + REFLEX_CREDIT_PAGE_SIZE - 1) /
+		REFLEX_CREDIT_PAGE_SIZE;
+}
+
+/*
+ * can req go out without exceeding the server's window
+ */
+static inline bool credit_available(struct pp_conn *conn, struct nvme_req *req)
+{
+	if (!conn->out_reqs)
+		return true;
+	return conn->out_reqs < conn->credit_reqs &&
+		conn->out_pages + req_pages(req) <= conn->credit_pages;
+}
+
+static void credit_return(struct pp_conn *conn, BINARY_HEADER *header,
+			  struct nvme_req *req)
+{
+	conn->out_reqs--;
+	conn->out_pages -= req_pages(req);
+	if (header->credit_reqs) {
+		conn->credit_reqs = header->credit_reqs;
+		conn->credit_pages = header->credit_pages;
+	}
+}
+
 static void receive_req(struct pp_conn *conn)
 {
 	ssize_t ret;
@@ -244,6 +288,21 @@ static void receive_req(struct pp_conn *conn)
 		header = (BINARY_HEADER *)&conn->data[0];
 		
 		assert(header->magic == sizeof(BINARY_HEADER)); 
+
+		if (header->opcode == CMD_REGISTER) {
+			req = header->req_handle;
+			credit_return(conn, header, req);
+			if ((long) header->lba < 0) {
+				fprintf(stderr, "server cannot meet SLO of tenant %lu, ret = %ld\n",
+					tenant_reg.tenant_id, (long) header->lba);
+				exit(-1);
+			}
+			mempool_free(&req_pool, req);
+			reg_waiting = false;
+			conn->rx_pending = false;
+			conn->rx_received = 0;
+			continue;
+		}
 				
 		if (header->opcode == CMD_GET) {
 			ret = ixev_recv(&conn->ctx,
@@ -276,6 +335,7 @@ static void receive_req(struct pp_conn *conn)
 		}
 
 		req = header->req_handle;
+		credit_return(conn, header, req);
 		if (req->cmd == CMD_GET) { //only report read latency (not write)
 			if (measure >= NUM_MEASURE && measure < NUM_MEASURE * 2) {
 				unsigned long now = rdtsc();
@@ -358,6 +418,10 @@ int send_req(struct nvme_req *req)
 	int ret = 0;
 	BINARY_HEADER *header;
 	
+	//hold back until the server has room for it
+	if (!conn->tx_pending && !conn->tx_sent && !credit_available(conn, req))
+		return -1;
+
 	if(!conn->tx_pending){
 		//setup header
 		header = (BINARY_HEADER *)&conn->data_send[0];
@@ -366,6 +430,8 @@ int send_req(struct nvme_req *req)
 		header->lba = req->lba;
 		header->lba_count = req->lba_count;
 		header->req_handle = req;
+		header->credit_reqs = 0;
+		header->credit_pages = 0;
 
 		while (conn->tx_sent < sizeof(BINARY_HEADER)) {
 			ret = ixev_send(&conn->ctx, &conn->data_send[conn->tx_sent],
@@ -387,9 +453,25 @@ int send_req(struct nvme_req *req)
 		assert(conn->tx_sent==sizeof(BINARY_HEADER));
 		conn->tx_pending = true;
 		conn->tx_sent = 0;
+		conn->out_reqs++;
+		conn->out_pages += req_pages(req);
 	}
 	ret = 0;
-	if (req->cmd == CMD_SET) {
+	if (req->cmd == CMD_REGISTER) {
+		while (conn->tx_sent < sizeof(REGISTER_BODY)) {
+			ret = ixev_send(&conn->ctx, (char *)&tenant_reg + conn->tx_sent,
+					sizeof(REGISTER_BODY) - conn->tx_sent);
+			if (ret == -EAGAIN)
+				return -1;
+			if (ret < 0) {
+				printf("Connection close 4\n");
+				ixev_close(&conn->ctx);
+				return -2;
+			}
+			conn->tx_sent += ret;
+		}
+	}
+	else if (req->cmd == CMD_SET) {
 		while (conn->tx_sent < req->lba_count * ns_sector_size) {
 			assert(req->lba_count * ns_sector_size);
 			ret = ixev_send_zc(&conn->ctx, &req->buf[conn->tx_sent],
@@ -620,6 +702,10 @@ static void *receive_loop(void *arg)
 	conn->list_len = 0x0UL;
 	conn->receive_loop = true;
 	conn->seq_count = 0;
+	conn->out_reqs = 0;
+	conn->out_pages = 0;
+	conn->credit_reqs = REFLEX_INIT_CREDIT_REQS;
+	conn->credit_pages = REFLEX_INIT_CREDIT_PAGES;
 	
 	ixev_ctx_init(&conn->ctx);
 	
@@ -638,6 +724,32 @@ static void *receive_loop(void *arg)
 		num_tests = NUM_TESTS;
 	while (!running)
 		ixev_wait();
+
+	if (register_slo) {
+		//tell the server our tenant and SLO before issuing any I/O
+		struct nvme_req *req = mempool_alloc(&req_pool);
+
+		tenant_reg.tenant_id = ip_tuple[tid]->dst_port;
+		tenant_reg.latency_us_SLO = latency_us_SLO;
+		tenant_reg.IOPS_SLO = IOPS_SLO;
+		tenant_reg.rw_ratio_SLO = rw_ratio_SLO;
+		tenant_reg.be_weight = be_weight;
+
+		req->cmd = CMD_REGISTER;
+		req->lba = 0;
+		req->lba_count = 0;
+		req->conn = conn;
+		req->buf = NULL;
+		conn->list_len++;
+		list_add_tail(&conn->pending_requests, &req->link);
+		reg_waiting = true;
+		send_pending_reqs(conn);
+		while (reg_waiting) {
+			send_pending_reqs(conn);
+			ixev_wait();
+		}
+	}
+
 	for (i = 0; i < num_tests; i++) {
 		terminate = false;
 		assert(sent == 0);
@@ -679,8 +791,8 @@ int main(int argc, char *argv[])
 	pthread_t thread[64];
 	int tid[64];
 	
-	if (argc != 10) {
-		fprintf(stderr, "Usage: %s IP PORT SEQUENTIAL? NUM_THREADS REQ/s READ_PERCENTAGE SWEEP REQ_SIZE PRECONDITION?\n",
+	if (argc != 10 && argc != 13 && argc != 14) {
+		fprintf(stderr, "Usage: %s IP PORT SEQUENTIAL? NUM_THREADS REQ/s READ_PERCENTAGE SWEEP REQ_SIZE PRECONDITION? [LATENCY_US_SLO IOPS_SLO RW_RATIO_SLO [BE_WEIGHT]]\n",
 			argv[0]);
 		return -1;
 	}
@@ -701,6 +813,14 @@ int main(int argc, char *argv[])
 	}
 	req_size = req_size_bytes / ns_sector_size;
 	preconditioning = atoi(argv[9]);
+	if (argc >= 13) {
+		register_slo = true;
+		latency_us_SLO = atoi(argv[10]);
+		IOPS_SLO = atol(argv[11]);
+		rw_ratio_SLO = atoi(argv[12]);
+	}
+	if (argc == 14)
+		be_weight = atoi(argv[13]);
 	
 	assert(nr_threads <= nr_cpu);
 	pthread_barrier_init(&barrier, NULL, nr_threads);
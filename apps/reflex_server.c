@@ -70,13 +70,37 @@
 #define NAMESPACE 0
 
 #define BINARY_HEADER binary_header_blk_t
+#define REGISTER_BODY binary_register_blk_t
+#define EXTENT_BODY binary_extent_blk_t
 
 #define NVME_ENABLE
 
 #define MAX_PAGES_PER_ACCESS 256 //64
+#define INLINE_PAGES_PER_ACCESS 4	//SGL kept in the nvme_req itself
+#define RESP_HDR_SLOTS 32		//response headers in flight per connection
+#define KARR_BATCH_RESERVE 64		//karr entries a batch leaves for other commands
 #define PAGE_SIZE 4096
 
 static int outstanding_reqs = 4096 * 64;
+
+/*
+ * Request and buffer memory is split evenly between the active tenants and
+ * then between each tenant's connections; a connection's share is the
+ * window advertised in every response (see binary_header_blk_t).
+ */
+#define CREDIT_MAX_TENANTS 1024
+#define CREDIT_MAX_REQS 1024	//cap per connection, fits the 16-bit field
+#define CREDIT_MAX_PAGES 8192
+
+struct tenant_share {
+	unsigned long tenant_id;
+	int conns;		//0 once the tenant's last connection is gone
+	bool used;		//ever used, keeps probe chains intact
+};
+
+static struct tenant_share tenant_shares[CREDIT_MAX_TENANTS];
+static int nr_active_tenants;
+static pthread_mutex_t tenant_share_lock = PTHREAD_MUTEX_INITIALIZER;
 static unsigned long ns_size;
 static unsigned long ns_sector_size;
 
@@ -85,6 +109,9 @@ static __thread struct mempool nvme_req_buf_pool;
 
 static struct mempool_datastore nvme_req_datastore;
 static __thread struct mempool nvme_req_pool;
+
+static struct mempool_datastore nvme_req_sgl_datastore;
+static __thread struct mempool nvme_req_sgl_pool;
 static __thread int conn_opened;
 static __thread long reqs_allocated = 0;
 
@@ -97,8 +124,21 @@ struct nvme_req {
 	struct ixev_ref ref;				//for zero-copy
 	unsigned long timestamp;
 	void *remote_req_handle;
-	char *buf[MAX_PAGES_PER_ACCESS]; 	//nvme buffer to read/write data into
+	long status;				//result returned in a CMD_REGISTER response
+	unsigned int credit_pages;		//pages charged to the connection's window
+	char **buf; 				//nvme buffers to read/write data into
+	struct nvme_req_sgl *sgl;		//extension for IOs over INLINE_PAGES_PER_ACCESS
 	int current_sgl_buf;
+	int nvme_left;				//extents not yet completed by the device
+	char *inline_buf[INLINE_PAGES_PER_ACCESS];
+};
+
+/*
+ * Most IOs are a few pages, so a request only carries a small SGL inline;
+ * larger IOs borrow a full-sized one from nvme_req_sgl_pool.
+ */
+struct nvme_req_sgl {
+	char *buf[MAX_PAGES_PER_ACCESS];
 };
 
 struct pp_conn {
@@ -113,10 +153,35 @@ struct pp_conn {
 	long list_len;
 	unsigned long req_received;
 	struct list_head pending_requests;
-	long nvme_fg_handle; //nvme flow group handle
+	long nvme_fg_handle; //nvme flow group handle, -1 if not registered
+	bool reg_pending;	//waiting for the kernel to (re)register the flow
+	struct nvme_req *reg_req; //CMD_REGISTER to respond to once registered
+	bool close_pending;	//rejected a request or hung up, close once in_flight_pkts drains
 	struct nvme_req *current_req;
-	char data_send[sizeof(BINARY_HEADER)]; //use zero-copy for payload
-	char data_recv[sizeof(BINARY_HEADER)]; //use zero-copy for payload
+	struct tenant_share *share; //tenant the connection is charged to
+	unsigned int out_reqs;	//requests received and not yet answered
+	unsigned int out_pages;
+	unsigned int win_reqs;	//window last advertised to the client
+	unsigned int win_pages;
+	bool over_window;	//holding a request header until the window opens
+	bool stalled;		//out of request memory, waiting on stalled_conns
+	struct list_node stall_link;
+	/*
+	 * Response headers are laid down back to back in this arena and sent
+	 * zero-copy, so headers of responses completed in the same ixev_wait
+	 * iteration go out as a single sg entry of one tcp_sendv. A slot is
+	 * reused once TCP has taken its bytes.
+	 */
+	BINARY_HEADER resp_hdr[RESP_HDR_SLOTS];
+	struct resp_hdr_ref {
+		struct ixev_ref ref;
+		struct pp_conn *conn;
+	} resp_hdr_ref[RESP_HDR_SLOTS];
+	unsigned int resp_hdr_head;	//next slot to fill
+	unsigned int resp_hdr_tail;	//oldest slot TCP has not taken yet
+	size_t rx_body;		//bytes of a batch extent list received so far
+	char data_recv[sizeof(BINARY_HEADER) +
+		       sizeof(EXTENT_BODY) * REFLEX_MAX_BATCH_EXTENTS]; //use zero-copy for payload
 };
 
 
@@ -124,27 +189,238 @@ static struct mempool_datastore pp_conn_datastore;
 static __thread struct mempool pp_conn_pool;
 
 static __thread hqu_t handle; 
+static __thread struct list_head stalled_conns;
 
 
 static void pp_main_handler(struct ixev_ctx *ctx, unsigned int reason);
+static void receive_req(struct pp_conn *conn);
 
-static void send_completed_cb(struct ixev_ref *ref)
+/*
+ * charge a connection to a tenant's share, returns NULL if every slot
+ * belongs to a tenant with connections
+ *
+ * Slots of tenants without connections are reused, but stay marked used
+ * so that lookups of tenants further along the probe chain still work.
+ */
+static struct tenant_share *tenant_share_get(unsigned long tenant_id)
+{
+	struct tenant_share *share = NULL, *free_slot = NULL;
+	int i, slot;
+
+	pthread_mutex_lock(&tenant_share_lock);
+	for (i = 0; i < CREDIT_MAX_TENANTS; i++) {
+		slot = (tenant_id + i) % CREDIT_MAX_TENANTS;
+		if (!tenant_shares[slot].used) {
+			if (!free_slot)
+				free_slot = &tenant_shares[slot];
+			break;
+		}
+		if (tenant_shares[slot].tenant_id == tenant_id) {
+			share = &tenant_shares[slot];
+			break;
+		}
+		if (!tenant_shares[slot].conns && !free_slot)
+			free_slot = &tenant_shares[slot];
+	}
+	if (!share && free_slot) {
+		share = free_slot;
+		share->used = true;
+		share->tenant_id = tenant_id;
+	}
+	if (share && !share->conns++)
+		nr_active_tenants++;
+	pthread_mutex_unlock(&tenant_share_lock);
+	return share;
+}
+
+static void tenant_share_put(struct tenant_share *share)
+{
+	if (!share)
+		return;
+	pthread_mutex_lock(&tenant_share_lock);
+	if (!--share->conns)
+		nr_active_tenants--;
+	pthread_mutex_unlock(&tenant_share_lock);
+}
+
+/*
+ * fill in the window a connection may use, read without the lock since a
+ * stale share only lasts until the next response
+ */
+static void set_credits(struct pp_conn *conn, BINARY_HEADER *header)
+{
+	long tenants = nr_active_tenants;
+	long conns = conn->share ? conn->share->conns : 1;
+	long share;
+
+	if (tenants < 1)
+		tenants = 1;
+	if (conns < 1)
+		conns = 1;
+	share = outstanding_reqs / tenants / conns;
+	header->credit_reqs = min(max(share, 1), CREDIT_MAX_REQS);
+	header->credit_pages = min(max(share, 1), CREDIT_MAX_PAGES);
+	conn->win_reqs = header->credit_reqs;
+	conn->win_pages = header->credit_pages;
+}
+
+static inline bool is_batch(uint16_t opcode)
+{
+	return opcode == CMD_GET_BATCH || opcode == CMD_SET_BATCH;
+}
+
+/* trim, flush and write zeroes move no data, in either direction */
+static inline bool has_payload(uint16_t opcode)
+{
+	return opcode == CMD_GET || opcode == CMD_SET || is_batch(opcode);
+}
+
+/*
+ * pages a request takes from the window, charged the way the client does
+ */
+static inline unsigned int req_credit_pages(BINARY_HEADER *header)
+{
+	if (!has_payload(header->opcode))
+		return 0;
+	return (header->lba_count * ns_sector_size + REFLEX_CREDIT_PAGE_SIZE - 1) /
+		REFLEX_CREDIT_PAGE_SIZE;
+}
+
+/*
+ * does a request fit in the window last advertised, a connection with
+ * nothing outstanding may always send one
+ */
+static inline bool credit_fits(struct pp_conn *conn, unsigned int pages)
+{
+	if (!conn->out_reqs)
+		return true;
+	return conn->out_reqs < conn->win_reqs &&
+		conn->out_pages + pages <= conn->win_pages;
+}
+
+/*
+ * a connection that could not get request memory or command space keeps
+ * its state and is retried from pp_main after the next ixev_wait
+ */
+static void stall_conn(struct pp_conn *conn)
+{
+	if (conn->stalled)
+		return;
+	conn->stalled = true;
+	list_add_tail(&stalled_conns, &conn->stall_link);
+}
+
+static void retry_stalled_conns(void)
+{
+	struct pp_conn *conn;
+	LIST_HEAD(retry);
+
+	list_append_list(&retry, &stalled_conns);
+	while ((conn = list_pop(&retry, struct pp_conn, stall_link))) {
+		conn->stalled = false;
+		receive_req(conn);
+	}
+}
+
+/*
+ * point the request at an SGL large enough for num4k pages
+ * returns 0 if successful and -1 if no extension SGL is available
+ */
+static int init_req_sgl(struct nvme_req *req, int num4k)
+{
+	if (num4k <= INLINE_PAGES_PER_ACCESS) {
+		req->sgl = NULL;
+		req->buf = req->inline_buf;
+	} else {
+		req->sgl = mempool_alloc(&nvme_req_sgl_pool);
+		if (!req->sgl)
+			return -1;
+		req->buf = req->sgl->buf;
+	}
+	return 0;
+}
+
+/*
+ * free the nvme buffers of a request
+ */
+static void free_req_bufs(struct nvme_req *req)
 {
-	struct nvme_req *req = container_of(ref, struct nvme_req, ref);
-	struct pp_conn *conn = req->conn;
 	int i, num4k;
-	
+
 	num4k = (req->lba_count * ns_sector_size) / 4096;
 	if (((req->lba_count * ns_sector_size) % 4096) != 0)
 		num4k++;
-	for (i = 0; i < num4k; i++) 
+	for (i = 0; i < num4k; i++)
 		mempool_free(&nvme_req_buf_pool, req->buf[i]);
+	if (req->sgl) {
+		mempool_free(&nvme_req_sgl_pool, req->sgl);
+		req->sgl = NULL;
+	}
+}
+
+static void close_conn(struct pp_conn *conn)
+{
+	if (conn->nvme_fg_handle >= 0)
+		ixev_nvme_unregister_flow(conn->nvme_fg_handle, (unsigned long) &conn->ctx);
+	conn->nvme_fg_handle = -1;
+	ixev_close(&conn->ctx);
+}
+
+/*
+ * free the request being received, with the buffers it got with the header
+ */
+static void drop_current_req(struct pp_conn *conn, BINARY_HEADER *header)
+{
+	struct nvme_req *req = conn->current_req;
+	int i, pages = 0;
+
+	if (has_payload(header->opcode))
+		pages = (header->lba_count * ns_sector_size + PAGE_SIZE - 1) / PAGE_SIZE;
+	for (i = 0; i < pages; i++)
+		mempool_free(&nvme_req_buf_pool, req->buf[i]);
+	if (req->sgl)
+		mempool_free(&nvme_req_sgl_pool, req->sgl);
+	conn->out_reqs--;
+	conn->out_pages -= req->credit_pages;
+	mempool_free(&nvme_req_pool, req);
+	reqs_allocated--;
+	conn->current_req = NULL;
+	conn->rx_pending = false;
+	conn->rx_received = 0;
+}
+
+/*
+ * drop a request that can't be served and close the connection, once the
+ * NVMe commands of the requests before it have completed
+ */
+static void reject_req(struct pp_conn *conn, BINARY_HEADER *header)
+{
+	drop_current_req(conn, header);
+	if (conn->in_flight_pkts) {
+		conn->close_pending = true;
+		return;
+	}
+	close_conn(conn);
+}
+
+static void send_completed_cb(struct ixev_ref *ref)
+{
+	struct nvme_req *req = container_of(ref, struct nvme_req, ref);
+	struct pp_conn *conn = req->conn;
 
+	free_req_bufs(req);
 	mempool_free(&nvme_req_pool, req);
 	reqs_allocated--;
 	conn->sent_pkts--;
 }
 
+static void resp_hdr_sent_cb(struct ixev_ref *ref)
+{
+	struct resp_hdr_ref *hdr_ref = container_of(ref, struct resp_hdr_ref, ref);
+
+	hdr_ref->conn->resp_hdr_tail++;
+}
+
 /*
  * returns 0 if send was successfull and -1 if tx path is busy
  */
@@ -152,22 +428,34 @@ int send_req(struct nvme_req *req)
 {
 	struct pp_conn *conn = req->conn;
 	int ret = 0;
-	BINARY_HEADER *header;
+	unsigned int slot = conn->resp_hdr_head % RESP_HDR_SLOTS;
+	BINARY_HEADER *header = &conn->resp_hdr[slot];
 
 	if(!conn->tx_pending){
-		//setup header
-		header = (BINARY_HEADER *)&conn->data_send[0];
-		header->magic = sizeof(BINARY_HEADER); //RESP_PKT;
-		header->opcode = req->opcode;
+		//a partly sent header must go out unchanged
+		if (!conn->tx_sent) {
+			if (conn->resp_hdr_head - conn->resp_hdr_tail == RESP_HDR_SLOTS)
+				return -1;
+
+			//setup header
+			header->magic = sizeof(BINARY_HEADER); //RESP_PKT;
+			header->opcode = req->opcode;
 		
-		if (req->opcode == CMD_SET)
-			header->lba_count = 0;
-		else
-			header->lba_count = req->lba_count;
-		header->req_handle = req->remote_req_handle;
+			if (req->opcode == CMD_SET || req->opcode == CMD_SET_BATCH ||
+			    req->opcode == CMD_REGISTER)
+				header->lba_count = 0;
+			else
+				header->lba_count = req->lba_count;
+			header->req_handle = req->remote_req_handle;
+			header->lba = (req->opcode == CMD_REGISTER) ? req->status : 0;
+			conn->out_reqs--;
+			conn->out_pages -= req->credit_pages;
+			set_credits(conn, header);
+		}
 
 		while (conn->tx_sent < (sizeof(BINARY_HEADER))) {
-			ret = ixev_send(&conn->ctx, &conn->data_send[conn->tx_sent], sizeof(BINARY_HEADER) - conn->tx_sent);
+			ret = ixev_send_zc(&conn->ctx, (char *) header + conn->tx_sent,
+					   sizeof(BINARY_HEADER) - conn->tx_sent);
 			if (ret == -EAGAIN)
 				return -1;
 			
@@ -181,11 +469,13 @@ int send_req(struct nvme_req *req)
 			conn->tx_sent += ret;
 		}
 	
+		conn->resp_hdr_head++;
+		ixev_add_sent_cb(&conn->ctx, &conn->resp_hdr_ref[slot].ref);
 		conn->tx_pending = true;
 		conn->tx_sent = 0;
 	}
 	ret = 0;
-	if (req->opcode == CMD_GET) {
+	if (req->opcode == CMD_GET || req->opcode == CMD_GET_BATCH) {
 		while (conn->tx_sent < req->lba_count * ns_sector_size) {		
 			int to_send = min(PAGE_SIZE - (conn->tx_sent % PAGE_SIZE),
 					  (req->lba_count * ns_sector_size) - conn->tx_sent);
@@ -215,14 +505,8 @@ int send_req(struct nvme_req *req)
 		req->ref.send_pos = req->lba_count * ns_sector_size;
 		ixev_add_sent_cb(&conn->ctx, &req->ref);
 	}
-	else { //PUT
-		int i, num4k;
-
-		num4k = (req->lba_count * ns_sector_size) / 4096;
-		if (((req->lba_count * ns_sector_size) % 4096) != 0)
-			num4k++;
-		for (i = 0; i < num4k; i++) 
-			mempool_free(&nvme_req_buf_pool, req->buf[i]);
+	else { //PUT, REGISTER, TRIM, FLUSH or WRITE_ZEROES
+		free_req_bufs(req);
 		mempool_free(&nvme_req_pool, req);
 		reqs_allocated--;
 		conn->sent_pkts--;
@@ -250,16 +534,45 @@ int send_pending_reqs(struct pp_conn *conn)
 	return sent_reqs;
 }
 
+/*
+ * the peer hung up, so there is no one to answer: free the request and close
+ * once the connection's last NVMe command has completed
+ */
+static void drop_completed_req(struct pp_conn *conn, struct nvme_req *req)
+{
+	free_req_bufs(req);
+	mempool_free(&nvme_req_pool, req);
+	reqs_allocated--;
+	if (conn->close_pending && !conn->in_flight_pkts)
+		close_conn(conn);
+}
+
 static void nvme_written_cb(struct ixev_nvme_req_ctx *ctx, unsigned int reason) 
 {
 	struct nvme_req *req = container_of(ctx, struct nvme_req, ctx);
 	struct pp_conn *conn = req->conn;
-	
-	conn->list_len++;
+
+	//a batch is answered once all of its extents are written
+	if (--req->nvme_left)
+		return;
+
 	conn->in_flight_pkts--;
+	if (conn->ctx.is_dead) {
+		drop_completed_req(conn, req);
+		return;
+	}
+	conn->list_len++;
 	conn->sent_pkts++;
 	list_add_tail(&conn->pending_requests, &req->link);
 	send_pending_reqs(conn);
+	if (conn->close_pending && !conn->in_flight_pkts) {
+		close_conn(conn);
+		return;
+	}
+	//a CMD_REGISTER may be waiting for in-flight I/O to drain, a held
+	//header for the response just sent to open the window
+	if ((!conn->in_flight_pkts && conn->rx_pending) || conn->over_window)
+		receive_req(conn);
 	return;
 }
 
@@ -268,11 +581,26 @@ static void nvme_response_cb(struct ixev_nvme_req_ctx *ctx, unsigned int reason)
 	struct nvme_req *req = container_of(ctx, struct nvme_req, ctx);
 	struct pp_conn *conn = req->conn;
 
-	conn->list_len++;
+	if (--req->nvme_left)
+		return;
+
 	conn->in_flight_pkts--;
+	if (conn->ctx.is_dead) {
+		drop_completed_req(conn, req);
+		return;
+	}
+	conn->list_len++;
 	conn->sent_pkts++;
 	list_add_tail(&conn->pending_requests, &req->link);
 	send_pending_reqs(conn);
+	if (conn->close_pending && !conn->in_flight_pkts) {
+		close_conn(conn);
+		return;
+	}
+	//a CMD_REGISTER may be waiting for in-flight I/O to drain, a held
+	//header for the response just sent to open the window
+	if ((!conn->in_flight_pkts && conn->rx_pending) || conn->over_window)
+		receive_req(conn);
 	return;
 }
 
@@ -288,13 +616,30 @@ static void nvme_opened_cb(hqu_t _handle, unsigned long _ns_size, unsigned long
 
 static void nvme_registered_flow_cb(long fg_handle, struct ixev_ctx* ctx, long ret)
 {
+	struct pp_conn *conn = container_of(ctx, struct pp_conn, ctx);
+	struct nvme_req *req = conn->reg_req;
+
 	if(ret < 0){
 		printf("ERROR: couldn't register flow\n");
 		//probably signifies you need a less strict SLO
+		conn->nvme_fg_handle = -1;
 	}
-	
-	struct pp_conn *conn = container_of(ctx, struct pp_conn, ctx);
-	conn->nvme_fg_handle = fg_handle;
+	else
+		conn->nvme_fg_handle = fg_handle;
+
+	conn->reg_pending = false;
+	if (req) {
+		//let the client know whether its SLO was admitted
+		conn->reg_req = NULL;
+		req->status = ret;
+		conn->list_len++;
+		conn->sent_pkts++;
+		list_add_tail(&conn->pending_requests, &req->link);
+		send_pending_reqs(conn);
+	}
+
+	//resume requests that arrived behind the registration
+	receive_req(conn);
 }
 
 static void nvme_unregistered_flow_cb(long flow_group_id , long ret)
@@ -311,6 +656,80 @@ static struct ixev_nvme_ops nvme_ops = {
 	.unregistered_flow    = &nvme_unregistered_flow_cb,
 };
 
+/*
+ * receive and check the extent list that follows a batch header
+ * returns 0 once it is complete and valid, -1 otherwise
+ */
+static int receive_extents(struct pp_conn *conn, BINARY_HEADER *header)
+{
+	EXTENT_BODY *ext = (EXTENT_BODY *)&conn->data_recv[sizeof(BINARY_HEADER)];
+	size_t len = header->lba * sizeof(EXTENT_BODY);
+	unsigned long i, sectors = 0, ns_sectors = ns_size / ns_sector_size;
+	ssize_t ret;
+
+	if (!header->lba || header->lba > REFLEX_MAX_BATCH_EXTENTS)
+		goto bad;
+	if (conn->rx_body == len)
+		return 0;
+
+	while (conn->rx_body < len) {
+		ret = ixev_recv(&conn->ctx,
+				&conn->data_recv[sizeof(BINARY_HEADER) + conn->rx_body],
+				len - conn->rx_body);
+		if (ret < 0) {
+			if (ret == -EAGAIN)
+				return -1;
+
+			if(!conn->nvme_pending) {
+				printf("Connection close 3\n");
+				ixev_close(&conn->ctx);
+			}
+			return -1;
+		}
+		conn->rx_body += ret;
+	}
+
+	for (i = 0; i < header->lba; i++) {
+		if (!ext[i].lba_count ||
+		    (ext[i].lba_count * ns_sector_size) % PAGE_SIZE ||
+		    ext[i].lba >= ns_sectors ||
+		    ext[i].lba_count > ns_sectors - ext[i].lba)
+			goto bad;
+		sectors += ext[i].lba_count;
+	}
+	if (sectors != header->lba_count)
+		goto bad;
+	return 0;
+
+bad:
+	printf("Received malformed batch, closing connection\n");
+	reject_req(conn, header);
+	return -1;
+}
+
+/*
+ * fan a batch out to one vectored NVMe command per extent, each reading
+ * or writing the next run of the request's pages
+ */
+static void submit_batch(struct pp_conn *conn, struct nvme_req *req,
+			 BINARY_HEADER *header)
+{
+	EXTENT_BODY *ext = (EXTENT_BODY *)&conn->data_recv[sizeof(BINARY_HEADER)];
+	int i, pages, page = 0;
+
+	req->nvme_left = header->lba;
+	for (i = 0; i < header->lba; i++) {
+		pages = (ext[i].lba_count * ns_sector_size) / PAGE_SIZE;
+		if (header->opcode == CMD_GET_BATCH)
+			ixev_nvme_readv(conn->nvme_fg_handle, (void**)&req->buf[page], pages,
+					ext[i].lba, ext[i].lba_count, (unsigned long)&req->ctx);
+		else
+			ixev_nvme_writev(conn->nvme_fg_handle, (void**)&req->buf[page], pages,
+					 ext[i].lba, ext[i].lba_count, (unsigned long)&req->ctx);
+		page += pages;
+	}
+}
+
 static void receive_req(struct pp_conn *conn)
 {
 	ssize_t ret;
@@ -320,30 +739,43 @@ static void receive_req(struct pp_conn *conn)
 	
 	while(1) {
 		int num4k;
+		unsigned int pages;
+		if (conn->reg_pending || conn->close_pending)
+			return;
+
 		if(!conn->rx_pending) {
 			int i;
-						
-			ret = ixev_recv(&conn->ctx, &conn->data_recv[conn->rx_received],
-					sizeof(BINARY_HEADER) - conn->rx_received); 
-			if (ret <= 0) {
-				if (ret != -EAGAIN) {
-					if(!conn->nvme_pending) {
-						printf("Connection close 6\n");
-						ixev_close(&conn->ctx);
+
+			//a stalled connection already holds its header
+			if (conn->rx_received < sizeof(BINARY_HEADER)) {
+				ret = ixev_recv(&conn->ctx, &conn->data_recv[conn->rx_received],
+						sizeof(BINARY_HEADER) - conn->rx_received); 
+				if (ret <= 0) {
+					if (ret != -EAGAIN) {
+						if(!conn->nvme_pending) {
+							printf("Connection close 6\n");
+							ixev_close(&conn->ctx);
+						}
 					}
+					return;
 				}
-				return;
-			}
-			else
-				conn->rx_received += ret;
+				else
+					conn->rx_received += ret;
 
-			if(conn->rx_received < sizeof(BINARY_HEADER))
-				return;
+				if(conn->rx_received < sizeof(BINARY_HEADER))
+					return;
+			}
 			
-			//received the header
+			//received the header, held until it fits in the window
+			header = (BINARY_HEADER *)&conn->data_recv[0];
+			pages = req_credit_pages(header);
+			conn->over_window = !credit_fits(conn, pages);
+			if (conn->over_window)
+				return;
+
 			conn->current_req = mempool_alloc(&nvme_req_pool);
 			if (!conn->current_req) {
-				printf("Cannot allocate nvme_usr req. In flight requests: %lu sent req %lu . list len %lu \n", conn->in_flight_pkts, conn->sent_pkts, conn->list_len);
+				stall_conn(conn);
 				return;
 			}
 			conn->current_req->current_sgl_buf = 0;
@@ -351,15 +783,29 @@ static void receive_req(struct pp_conn *conn)
 			header = (BINARY_HEADER *)&conn->data_recv[0];
 			
 			assert(header->magic == sizeof(BINARY_HEADER));
-			num4k = (header->lba_count * ns_sector_size) / 4096;
-			assert(num4k <= MAX_PAGES_PER_ACCESS);
-			if (((header->lba_count * ns_sector_size) % 4096) != 0)
-				num4k++;
+			num4k = 0;
+			if (has_payload(header->opcode)) {
+				num4k = (header->lba_count * ns_sector_size) / 4096;
+				assert(num4k <= MAX_PAGES_PER_ACCESS);
+				if (((header->lba_count * ns_sector_size) % 4096) != 0)
+					num4k++;
+			}
+			if (init_req_sgl(conn->current_req, num4k)) {
+				mempool_free(&nvme_req_pool, conn->current_req);
+				conn->current_req = NULL;
+				stall_conn(conn);
+				return;
+			}
 			for (i = 0; i < num4k; i++) {
 				conn->current_req->buf[i] = mempool_alloc(&nvme_req_buf_pool);
 				if (!conn->current_req->buf[i]) {
-					printf("Cannot allocate nvme_usr req buf. Req allocated: %lx. In flight requests: %lu sent req %lu . list len %lu \n",
-					       reqs_allocated, conn->in_flight_pkts, conn->sent_pkts, conn->list_len);
+					while (i--)
+						mempool_free(&nvme_req_buf_pool, conn->current_req->buf[i]);
+					if (conn->current_req->sgl)
+						mempool_free(&nvme_req_sgl_pool, conn->current_req->sgl);
+					mempool_free(&nvme_req_pool, conn->current_req);
+					conn->current_req = NULL;
+					stall_conn(conn);
 					return;
 				}
 			}
@@ -367,8 +813,12 @@ static void receive_req(struct pp_conn *conn)
 			ixev_nvme_req_ctx_init(&conn->current_req->ctx);
 
 			reqs_allocated++;
+			conn->current_req->credit_pages = pages;
+			conn->out_reqs++;
+			conn->out_pages += pages;
 			conn->rx_pending = true;
 			conn->rx_received = 0;
+			conn->rx_body = 0;
 		}
 
 		req = conn->current_req;
@@ -376,7 +826,10 @@ static void receive_req(struct pp_conn *conn)
 		
 		assert(header->magic == sizeof(BINARY_HEADER));
 		
-		if (header->opcode == CMD_SET) {
+		if (is_batch(header->opcode) && receive_extents(conn, header))
+			return;
+
+		if (header->opcode == CMD_SET || header->opcode == CMD_SET_BATCH) {
 			while (conn->rx_received < header->lba_count * ns_sector_size) {		
 				int to_receive = min(PAGE_SIZE - (conn->rx_received % PAGE_SIZE),
 						  (header->lba_count * ns_sector_size) - conn->rx_received);
@@ -405,22 +858,115 @@ static void receive_req(struct pp_conn *conn)
 			assert(req->current_sgl_buf <= header->lba_count * 8);
 
 		}
-		else if (header->opcode == CMD_GET) {}
+		else if (header->opcode == CMD_REGISTER) {
+			REGISTER_BODY *reg;
+			struct tenant_share *share = NULL;
+
+			while (conn->rx_received < sizeof(REGISTER_BODY)) {
+				ret = ixev_recv(&conn->ctx,
+						&conn->data_recv[sizeof(BINARY_HEADER) + conn->rx_received],
+						sizeof(REGISTER_BODY) - conn->rx_received);
+				if (ret < 0) {
+					if (ret == -EAGAIN)
+						return;
+
+					if(!conn->nvme_pending) {
+						printf("Connection close 3\n");
+						ixev_close(&conn->ctx);
+					}
+					return;
+				}
+				conn->rx_received += ret;
+			}
+
+			//don't pull the flow from under requests still in flight
+			if (conn->in_flight_pkts)
+				return;
+
+			reg = (REGISTER_BODY *)&conn->data_recv[sizeof(BINARY_HEADER)];
+			req->opcode = header->opcode;
+			req->lba_count = 0;
+			req->remote_req_handle = header->req_handle;
+			req->conn = conn;
+
+			//the per-port default tenants are not the client's to join
+			if (reg->tenant_id & REFLEX_PORT_TENANT_BIT)
+				req->status = -RET_INVAL;
+			else if (!(share = tenant_share_get(reg->tenant_id)))
+				req->status = -RET_NOBUFS;
+			if (!share) {
+				conn->list_len++;
+				conn->sent_pkts++;
+				list_add_tail(&conn->pending_requests, &req->link);
+				send_pending_reqs(conn);
+				conn->rx_received = 0;
+				conn->rx_pending = false;
+				continue;
+			}
+
+			if (conn->nvme_fg_handle >= 0)
+				ixev_nvme_unregister_flow(conn->nvme_fg_handle, (unsigned long) &conn->ctx);
+			conn->nvme_fg_handle = -1;
+			tenant_share_put(conn->share);
+			conn->share = share;
+			conn->reg_req = req;
+			conn->reg_pending = true;
+			ixev_nvme_register_flow(reg->tenant_id, (unsigned long) &conn->ctx,
+						reg->latency_us_SLO, reg->IOPS_SLO,
+						reg->rw_ratio_SLO, reg->be_weight);
+
+			conn->rx_received = 0;
+			conn->rx_pending = false;
+			continue;
+		}
+		else if (header->opcode == CMD_GET || header->opcode == CMD_GET_BATCH) {}
+		else if (header->opcode == CMD_TRIM || header->opcode == CMD_WRITE_ZEROES) {
+			unsigned long ns_sectors = ns_size / ns_sector_size;
+
+			if (!header->lba_count ||
+			    (header->opcode == CMD_WRITE_ZEROES &&
+			     header->lba_count > REFLEX_MAX_WRITE_ZEROES_SECTORS) ||
+			    header->lba >= ns_sectors ||
+			    header->lba_count > ns_sectors - header->lba) {
+				printf("Received invalid trim/write zeroes range, closing connection\n");
+				reject_req(conn, header);
+				return;
+			}
+		}
+		else if (header->opcode == CMD_FLUSH) {}
 		else {
 			printf("Received unsupported command, closing connection\n");
-			ixev_close(&conn->ctx);
+			reject_req(conn, header);
+			return;
+		}
+
+		if (conn->nvme_fg_handle < 0) {
+			printf("Received I/O without a registered SLO, closing connection\n");
+			reject_req(conn, header);
+			return;
+		}
+
+		//a batch takes a karr entry per extent, wait for the next ixev_wait
+		//to flush them rather than run out of command space
+		if (is_batch(header->opcode) &&
+		    karr->len + header->lba + KARR_BATCH_RESERVE > karr->max_len) {
+			stall_conn(conn);
 			return;
 		}
 
 		req->opcode = header->opcode;
-		req->lba_count = header->lba_count;
+		//lba_count sizes the request's buffers and the response payload
+		req->lba_count = has_payload(header->opcode) ? header->lba_count : 0;
 		req->remote_req_handle = header->req_handle;
 				
 		req->ctx.handle = handle;
 		req->conn = conn;
+		req->nvme_left = 1;
 
-		nvme_addr = (void*)(header->lba << 9); 
-		assert((unsigned long)nvme_addr < ns_size); 
+		if (header->opcode == CMD_GET || header->opcode == CMD_SET) {
+			nvme_addr = (void*)(header->lba << 9); 
+			assert((unsigned long)nvme_addr < ns_size); 
+		}
 		
 		conn->in_flight_pkts++;
 		num4k = (header->lba_count * ns_sector_size) / PAGE_SIZE;
@@ -442,11 +988,33 @@ static void receive_req(struct pp_conn *conn)
 					header->lba, header->lba_count, (unsigned long)&req->ctx);
 			conn->nvme_pending++;	
 			break;
-		default:
-			printf("Received illegal msg - dropping msg\n");
-			mempool_free(&nvme_req_buf_pool, req->buf);
-			mempool_free(&nvme_req_pool, req);
-			reqs_allocated--;
+		case CMD_SET_BATCH:
+			ixev_set_nvme_handler(&req->ctx, IXEV_NVME_WR, &nvme_written_cb);
+			submit_batch(conn, req, header);
+			conn->nvme_pending++;
+			break;
+		case CMD_GET_BATCH:
+			ixev_set_nvme_handler(&req->ctx, IXEV_NVME_RD, &nvme_response_cb);
+			submit_batch(conn, req, header);
+			conn->nvme_pending++;
+			break;
+		case CMD_TRIM:
+			ixev_set_nvme_handler(&req->ctx, IXEV_NVME_WR, &nvme_written_cb);
+			ixev_nvme_trim(conn->nvme_fg_handle, header->lba, header->lba_count,
+				       (unsigned long)&req->ctx);
+			conn->nvme_pending++;
+			break;
+		case CMD_WRITE_ZEROES:
+			ixev_set_nvme_handler(&req->ctx, IXEV_NVME_WR, &nvme_written_cb);
+			ixev_nvme_write_zeroes(conn->nvme_fg_handle, header->lba, header->lba_count,
+					       (unsigned long)&req->ctx);
+			conn->nvme_pending++;
+			break;
+		case CMD_FLUSH:
+			ixev_set_nvme_handler(&req->ctx, IXEV_NVME_WR, &nvme_written_cb);
+			ixev_nvme_flush(conn->nvme_fg_handle, (unsigned long)&req->ctx);
+			conn->nvme_pending++;
+			break;
 		}
 		conn->rx_received = 0;
 		conn->rx_pending = false;
@@ -462,8 +1030,12 @@ static void pp_main_handler(struct ixev_ctx *ctx, unsigned int reason)
 		send_pending_reqs(conn);
 	}
 	if(reason==IXEVHUP) {
-		ixev_nvme_unregister_flow(conn->nvme_fg_handle);
-		ixev_close(&conn->ctx);
+		//the NVMe commands in flight complete on this connection
+		if (conn->in_flight_pkts) {
+			conn->close_pending = true;
+			return;
+		}
+		close_conn(conn);
 		return;
 	}
 	receive_req(conn);
@@ -471,11 +1043,7 @@ static void pp_main_handler(struct ixev_ctx *ctx, unsigned int reason)
 
 static struct ixev_ctx *pp_accept(struct ip_tuple *id)
 {
-	unsigned long cookie;
-	unsigned int latency_us_SLO = 0;
-	unsigned long IOPS_SLO = 0;
-	int rd_wr_ratio_SLO = 50;
-	
+	int i;
 	struct pp_conn *conn = mempool_alloc(&pp_conn_pool);
 	if (!conn) {
 		printf("MEMPOOL ALLOC FAILED !\n");
@@ -490,58 +1058,38 @@ static struct ixev_ctx *pp_accept(struct ip_tuple *id)
 	conn->sent_pkts = 0x0UL;
 	conn->list_len = 0x0UL;
 	conn->req_received = 0;
+	conn->close_pending = false;
+	conn->stalled = false;
+	conn->share = tenant_share_get(REFLEX_PORT_TENANT_BIT | id->dst_port);
+	if (!conn->share) {
+		printf("Tenant share table full, refusing connection\n");
+		mempool_free(&pp_conn_pool, conn);
+		return NULL;
+	}
+	conn->out_reqs = 0;
+	conn->out_pages = 0;
+	conn->win_reqs = REFLEX_INIT_CREDIT_REQS;
+	conn->win_pages = REFLEX_INIT_CREDIT_PAGES;
+	conn->over_window = false;
+	conn->resp_hdr_head = 0;
+	conn->resp_hdr_tail = 0;
+	for (i = 0; i < RESP_HDR_SLOTS; i++) {
+		conn->resp_hdr_ref[i].ref.cb = &resp_hdr_sent_cb;
+		conn->resp_hdr_ref[i].conn = conn;
+	}
 	ixev_ctx_init(&conn->ctx);
 	ixev_set_handler(&conn->ctx, IXEVIN | IXEVOUT | IXEVHUP, &pp_main_handler);
 	conn_opened++;
 
-	conn->nvme_fg_handle = 0; //set to this for now
-	cookie = (unsigned long) &conn->ctx;
-
-	/****************************************/
-	/* LATENCY SLO POLICIES FOR FLOW GROUPS */
-	switch (id->dst_port) {
-
-	case 1234:
-		latency_us_SLO = 0; //best-effort
-		IOPS_SLO = 0;
-		rd_wr_ratio_SLO = 100;
-		break; 
-	case 1235:
-		latency_us_SLO = 0; //best-effort
-		IOPS_SLO = 0;
-		rd_wr_ratio_SLO = 100;
-		break;
-	case 1236:
-		latency_us_SLO = 0; //best-effort
-		IOPS_SLO = 0;
-		rd_wr_ratio_SLO = 100;
-		break;
-	case 1237:
-		latency_us_SLO = 0; //best-effort
-		IOPS_SLO = 0;
-		rd_wr_ratio_SLO = 100;
-		break;
-	case 5678: 
-		latency_us_SLO = 1000; //latency-critical
-		IOPS_SLO = 120000;
-		rd_wr_ratio_SLO = 100;
-		break;
-	case 5679: 
-		latency_us_SLO = 1000; //latency-critical
-		IOPS_SLO = 70000;
-		rd_wr_ratio_SLO = 80;
-		break;
-
-	default:
-		printf("WARNING: unrecognized SLO policy, default is best-effort\n");
-		break;
-	}
 	/*
-	 * FIXME: add support for dynamic SLO registration by client
-	 * Current hack: associate a port with an SLO (defined in case statement above)
-	 * Client communicates with server using dst_port that corresponds to its SLO
+	 * Until the client sends a CMD_REGISTER with its tenant id and SLO,
+	 * the connection is served as a best-effort tenant keyed by port.
 	 */
-	ixev_nvme_register_flow(id->dst_port, cookie, latency_us_SLO, IOPS_SLO, rd_wr_ratio_SLO);
+	conn->nvme_fg_handle = -1;
+	conn->reg_req = NULL;
+	conn->reg_pending = true;
+	ixev_nvme_register_flow(REFLEX_PORT_TENANT_BIT | id->dst_port,
+				(unsigned long) &conn->ctx, 0, 0, 100, 1);
 	return &conn->ctx;
 }
 
@@ -550,6 +1098,9 @@ static void pp_release(struct ixev_ctx *ctx)
 	struct pp_conn *conn = container_of(ctx, struct pp_conn, ctx);
 	conn_opened--;
 	
+	if (conn->stalled)
+		list_del(&conn->stall_link);
+	tenant_share_put(conn->share);
 	mempool_free(&pp_conn_pool, conn);
 }
 
@@ -581,15 +1132,27 @@ static void *pp_main(void *arg)
 		return NULL;
 	}
 
+	ret = mempool_create(&nvme_req_sgl_pool, &nvme_req_sgl_datastore);
+	if (ret) {
+		fprintf(stderr, "unable to create mempool\n");
+		return NULL;
+	}
+	/* every thread asks; the dataplane translates the pool only once */
+	ixev_nvme_register_buf(nvme_req_buf_datastore.buf,
+			       nvme_req_buf_datastore.nr_pages * PGSIZE_2MB);
+
 	ret = mempool_create(&pp_conn_pool, &pp_conn_datastore);
 	if (ret) {
 		fprintf(stderr, "unable to create mempool\n");
 		return NULL;
 	}
 
+	list_head_init(&stalled_conns);
 	ixev_nvme_open(NAMESPACE, 1);
 	while (1) {
 		ixev_wait();
+		if (!list_empty(&stalled_conns))
+			retry_stalled_conns();
 	}
 
 	return NULL;
@@ -626,6 +1189,14 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "unable to create datastore\n");
 		return ret;
 	}
+	ret = mempool_create_datastore(&nvme_req_sgl_datastore, 
+				       outstanding_reqs / 16,
+				       sizeof(struct nvme_req_sgl), false, 
+				       MEMPOOL_DEFAULT_CHUNKSIZE, "nvme_req_sgl");
+	if (ret) {
+		fprintf(stderr, "unable to create datastore\n");
+		return ret;
+	}
 
 	pp_conn_pool_entries = ROUND_UP(16 * 4096, MEMPOOL_DEFAULT_CHUNKSIZE);
 
@@ -103,6 +103,9 @@ static int parse_cpu(void);
 static int parse_batch(void);
 static int parse_loader_path(void);
 static int parse_scheduler_mode(void);
+static int parse_tenant_rebalance(void);
+static int parse_work_stealing(void);
+static int parse_rw_queue_policy(void);
 
 extern int ixgbe_fdir_add_rule(uint32_t dst_addr, uint32_t src_addr, uint16_t dst_port, int queue_id);
 
@@ -123,6 +126,9 @@ static struct config_vector_t config_tbl[] = {
 	{ "batch",        parse_batch},
 	{ "loader_path",  parse_loader_path},
 	{ "scheduler", 	  parse_scheduler_mode},
+	{ "tenant_rebalance", parse_tenant_rebalance},
+	{ "work_stealing", parse_work_stealing},
+	{ "rw_queue_policy", parse_rw_queue_policy},
 	{ NULL,           NULL}
 };
 
@@ -393,6 +399,48 @@ int compare_lat_tokenrate (const void * a, const void * b)
    return ( a_pair->p95_tail_latency - b_pair->p95_tail_latency );
 }
 
+static int compare_cost_point(const void *a, const void *b)
+{
+	const struct nvme_cost_point *a_point = a;
+	const struct nvme_cost_point *b_point = b;
+	return (int) a_point->size - (int) b_point->size;
+}
+
+/*
+ * parse_cost_curve - parse an optional list of {size, cost} points that
+ * overrides the linear cost model for one opcode
+ */
+static int parse_cost_curve(const char *name, struct nvme_cost_curve *curve)
+{
+	config_setting_t *points, *entry;
+	int i, size, cost;
+
+	curve->num_points = 0;
+	points = config_lookup(&cfg_devmodel, name);
+	if (!points)
+		return 0;
+
+	if (config_setting_length(points) > NVME_MAX_COST_POINTS) {
+		log_err("%s: more than %d points\n", name, NVME_MAX_COST_POINTS);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < config_setting_length(points); i++) {
+		size = cost = 0;
+		entry = config_setting_get_elem(points, i);
+		config_setting_lookup_int(entry, "size", &size);
+		config_setting_lookup_int(entry, "cost", &cost);
+		if (size <= 0 || cost <= 0)
+			return -EINVAL;
+		curve->points[i].size = size;
+		curve->points[i].cost = cost;
+	}
+	curve->num_points = i;
+	qsort(curve->points, curve->num_points, sizeof(struct nvme_cost_point), &compare_cost_point);
+	log_info("NVMe device model: %s with %d points\n", name, curve->num_points);
+	return 0;
+}
+
 static int parse_nvme_device_model(void)
 {
 	config_setting_t *devs = NULL;
@@ -401,6 +449,7 @@ static int parse_nvme_device_model(void)
 	config_setting_t *write_cost;
 	config_setting_t *max_token_rate;
 	config_setting_t *token_limits = NULL, *entry = NULL;
+	int online = 0, interval_ms = 0;
 	int i;
 
 	devs = config_lookup(&cfg, "nvme_device_model");
@@ -416,6 +465,9 @@ static int parse_nvme_device_model(void)
 		nvme_dev_model = FAKE_FLASH;
 		NVME_READ_COST = 100; // default read cost
 		NVME_WRITE_COST = 2000; // default write cost
+		NVME_TRIM_COST = NVME_WRITE_COST;
+		NVME_FLUSH_COST = NVME_WRITE_COST;
+		NVME_WRITE_ZEROES_COST = NVME_WRITE_COST;
 		return 0;
 	}
 	if (!strcmp(dev_model_, "default")){
@@ -460,6 +512,18 @@ static int parse_nvme_device_model(void)
 		NVME_WRITE_COST = 2000; // default write cost
 	}
 
+	// commands that move no data default to the cost of a 4KB write
+	NVME_TRIM_COST = NVME_WRITE_COST;
+	NVME_FLUSH_COST = NVME_WRITE_COST;
+	NVME_WRITE_ZEROES_COST = NVME_WRITE_COST;
+	config_lookup_int(&cfg_devmodel, "trim_cost", &NVME_TRIM_COST);
+	config_lookup_int(&cfg_devmodel, "flush_cost", &NVME_FLUSH_COST);
+	config_lookup_int(&cfg_devmodel, "write_zeroes_cost_4KB", &NVME_WRITE_ZEROES_COST);
+	if (NVME_TRIM_COST < 0 || NVME_FLUSH_COST < 0 || NVME_WRITE_ZEROES_COST < 0) {
+		log_err("trim, flush and write zeroes costs must not be negative\n");
+		return -EINVAL;
+	}
+
 	// parse token limits and store in memory for lookup during runtime	
 	if (config_setting_get_int(max_token_rate)) {
 		MAX_DEV_TOKEN_RATE = config_setting_get_int(max_token_rate);
@@ -468,6 +532,17 @@ static int parse_nvme_device_model(void)
 		MAX_DEV_TOKEN_RATE = UINT_MAX; // default max token rate
 	}
 
+	// optional per-size cost curves and sequential write discount
+	if (parse_cost_curve("read_cost_by_size", &nvme_read_cost_curve) ||
+	    parse_cost_curve("write_cost_by_size", &nvme_write_cost_curve))
+		return -EINVAL;
+	nvme_seq_write_discount = 0;
+	config_lookup_int(&cfg_devmodel, "seq_write_discount", &nvme_seq_write_discount);
+	if (nvme_seq_write_discount < 0 || nvme_seq_write_discount > 100) {
+		log_err("seq_write_discount must be a percentage\n");
+		return -EINVAL;
+	}
+
 	token_limits = config_lookup(&cfg_devmodel, "token_limits");
 	if (!token_limits) {
 		log_info("WARNING: return no token limits specified.\n");
@@ -500,6 +575,18 @@ static int parse_nvme_device_model(void)
 	// sort dev_model array for easy lookup during runtime
 	qsort (dev_model, dev_model_size, sizeof(struct lat_tokenrate_pair), &compare_lat_tokenrate);
 
+	// optionally keep refining the model from measured completion latency
+	nvme_devmodel_online = false;
+	nvme_devmodel_interval_ms = 100;
+	config_lookup_bool(&cfg_devmodel, "online_calibration", &online);
+	if (online) {
+		nvme_devmodel_online = true;
+		config_lookup_int(&cfg_devmodel, "calibration_interval_ms", &interval_ms);
+		if (interval_ms > 0)
+			nvme_devmodel_interval_ms = interval_ms;
+		log_info("NVMe device model: online calibration every %d ms\n", nvme_devmodel_interval_ms);
+	}
+
 	//log_info("WARNING: only support 1 device type for now\n");
 	return 0;
 }
@@ -536,6 +623,64 @@ static int parse_scheduler_mode(void)
 	return 0;
 }
 
+/* parses an optional "on"/"off" setting, off by default */
+static int parse_on_off(const char *name, bool *flag)
+{
+	const char *mode = NULL;
+
+	*flag = false;
+	if (!config_lookup_string(&cfg, name, &mode))
+		return 0;
+	if (!strcmp(mode, "on")) {
+		*flag = true;
+		log_info("%s: ON\n", name);
+	} else if (strcmp(mode, "off")) {
+		log_err("cfg: %s must be \"on\" or \"off\"\n", name);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static int parse_tenant_rebalance(void)
+{
+	return parse_on_off("tenant_rebalance", &nvme_rebalance_flag);
+}
+
+static int parse_work_stealing(void)
+{
+	return parse_on_off("work_stealing", &nvme_steal_flag);
+}
+
+static int parse_rw_queue_policy(void)
+{
+	const char *policy = NULL;
+	int ratio = 4;
+
+	nvme_rw_policy = NVME_RW_TOKEN_FAIR;
+	nvme_rw_ratio = ratio;
+	if (!config_lookup_string(&cfg, "rw_queue_policy", &policy))
+		return 0;
+
+	if (!strcmp(policy, "token_fair")) {
+		nvme_rw_policy = NVME_RW_TOKEN_FAIR;
+	} else if (!strcmp(policy, "read_priority")) {
+		nvme_rw_policy = NVME_RW_READ_PRIORITY;
+	} else if (!strcmp(policy, "ratio")) {
+		config_lookup_int(&cfg, "rw_queue_ratio", &ratio);
+		if (ratio < 1) {
+			log_err("cfg: rw_queue_ratio must be at least 1\n");
+			return -EINVAL;
+		}
+		nvme_rw_policy = NVME_RW_RATIO;
+		nvme_rw_ratio = ratio;
+	} else {
+		log_err("cfg: unknown rw_queue_policy %s\n", policy);
+		return -EINVAL;
+	}
+	log_info("Read/write queue policy: %s\n", policy);
+	return 0;
+}
+
 static int add_cpu(int cpu)
 {
 	int i;
@@ -639,6 +784,9 @@ static void usage(char *argv[])
 		"\tUse CONFIG_FILE as default config.\n"
 		"--log|-l\n"
 		"\tSets log level: 0:EMERG, 1:CRIT, 2:ERR, 3:WARN, 4:INFO, 5:DEBUG. Default: 5\n"
+		"--profile|-p [DEVMODEL_FILE]\n"
+		"\tProfile the NVMe device, write a device model to DEVMODEL_FILE and exit.\n"
+		"\tWARNING: overwrites data on the device.\n"
 		, argv[0]);
 }
 
@@ -648,9 +796,10 @@ static int parse_arguments(int argc, char *argv[], int *args_parsed)
 	static struct option long_options[] = {
 		{"config", required_argument, NULL, 'c'},
 		{"log", required_argument, NULL, 'l'},
+		{"profile", required_argument, NULL, 'p'},
 		{NULL, 0, NULL, 0}
 	};
-	static const char *optstring = "c:l:";
+	static const char *optstring = "c:l:p:";
 
 	while (true) {
 		c = getopt_long(argc, argv, optstring, long_options, NULL);
@@ -670,6 +819,10 @@ static int parse_arguments(int argc, char *argv[], int *args_parsed)
 			}
 			max_loglevel = atoi(optarg);
 			break;
+		case 'p':
+			strncpy(CFG.nvme_profile_file, optarg, sizeof(CFG.nvme_profile_file));
+			CFG.nvme_profile_file[sizeof(CFG.nvme_profile_file) - 1] = '\0';
+			break;
 		default:
 			fprintf(stderr, "cfg: invalid command option %x\n", c);
 			ret = -EINVAL;
@@ -345,6 +345,19 @@ void eth_fg_assign_to_cpu(bitmap_ptr fg_bitmap, int cpu)
 
 }
 
+/**
+ * eth_fg_migration_busy - is a migration from this cpu, or to the given
+ * cpu, still in transition?
+ * @cpu: the cpu sequence number
+ *
+ * eth_fg_assign_to_cpu() must not be called while it is.
+ */
+bool eth_fg_migration_busy(int cpu)
+{
+	return percpu_get(migration_info).prev_cpu != -1 ||
+	       percpu_get_remote(migration_info, CFG.cpu[cpu]).prev_cpu != -1;
+}
+
 static void transition_handler_prev(struct timer *t, struct eth_fg *cur_fg)
 {
 	struct migration_info *info = container_of(t, struct migration_info, transition_timeout);
@@ -110,6 +110,7 @@ extern int cp_init(void);
 extern int mempool_init(void);
 extern int init_migration_cpu(void);
 extern int dpdk_init(void);
+extern int nvme_profile_device(const char *path);
 
 
 struct init_vector_t {
@@ -561,6 +562,11 @@ int main(int argc, char *argv[])
 				panic("could not initialize IX\n");
 		}
 
+	if (CFG.nvme_profile_file[0]) {
+		log_info("init: profiling NVMe device\n");
+		return nvme_profile_device(CFG.nvme_profile_file);
+	}
+
 	ret = sandbox_init(argc - args_parsed, &argv[args_parsed]);
 	if (ret) {
 		log_err("init: failed to start sandbox\n");
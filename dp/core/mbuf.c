@@ -63,6 +63,8 @@
 #include <ix/mempool.h>
 #include <ix/mbuf.h>
 #include <ix/cpu.h>
+#include <ix/log.h>
+#include <ix/nvmedev.h>
 
 /* Capacity should be at least RX queues per CPU * ETH_DEV_RX_QUEUE_SZ */
 #define MBUF_CAPACITY	20480 /* Originally set to (768*1024), but decrease # of mbufs allocated
@@ -110,6 +112,11 @@ int mbuf_init(void)
 		mempool_pagemem_destroy(m);
 		return ret;
 	}
+
+	/* received mbufs are handed to the NVMe driver as write payload */
+	ret = nvme_register_buf_region(m->iomap_addr, m->nr_pages * PGSIZE_2MB);
+	if (ret)
+		log_info("mbuf: NVMe buffer registration failed, ret = %d\n", ret);
 	return 0;
 }
 
@@ -32,8 +32,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include <ix/nvme_sw_queue.h>
+#include <ix/cfg.h>
 #include <ix/errno.h>
 #include <ix/log.h>
 #include <ix/timer.h>
@@ -41,38 +43,151 @@
 
 void nvme_sw_queue_init(struct nvme_sw_queue *q, long fg_handle)
 {
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		q->ring[i].buf = q->ring[i].inline_buf;
+		q->ring[i].mask = NVME_SW_RING_INLINE - 1;
+		q->ring[i].count = 0;
+		q->ring[i].head = 0;
+		q->ring[i].tail = 0;
+		list_head_init(&q->ring[i].overflow);
+		q->served[i] = 0;
+	}
 	q->count = 0;
-    q->head = 0;
-    q->tail = 0;
+	q->reads_in_row = 0;
 	q->total_token_demand = 0;
 	q->saved_tokens = 0;
 	q->token_credit = 0;
+	q->last_increment = 0;
+	q->token_frac = 0;
+	q->sched_tokens = 0;
+	q->load = 0;
 	q->fg_handle = fg_handle;
+	q->active = false;
 }
 
-int nvme_sw_queue_push_back(struct nvme_sw_queue *q, struct nvme_ctx *ctx)
+void nvme_sw_queue_destroy(struct nvme_sw_queue *q)
 {
-    if(q->count == NVME_SW_QUEUE_SIZE){ 
-		log_info("nvme_sw_queue full!\n");
-		return -EAGAIN;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (q->ring[i].buf != q->ring[i].inline_buf)
+			free(q->ring[i].buf);
+		q->ring[i].buf = q->ring[i].inline_buf;
+	}
+}
+
+/*
+ * nvme_sw_ring_grow - double the slots of a full ring
+ *
+ * Returns 0 if successful, otherwise the ring stays as it is.
+ */
+static int nvme_sw_ring_grow(struct nvme_sw_ring *r)
+{
+	unsigned int slots = r->mask + 1;
+	struct nvme_ctx **buf;
+	unsigned int i;
+
+	if (slots >= NVME_SW_QUEUE_SIZE)
+		return -ENOMEM;
+	buf = malloc(2 * slots * sizeof(*buf));
+	if (!buf)
+		return -ENOMEM;
+
+	// unwrap the full ring into the front of the new one
+	for (i = 0; i < slots; i++)
+		buf[i] = r->buf[(r->tail + i) & r->mask];
+	if (r->buf != r->inline_buf)
+		free(r->buf);
+
+	r->buf = buf;
+	r->mask = 2 * slots - 1;
+	r->tail = 0;
+	r->head = slots;
+	return 0;
+}
+
+static inline void nvme_sw_ring_put(struct nvme_sw_ring *r, struct nvme_ctx *ctx)
+{
+	r->buf[r->head] = ctx;
+	r->head = (r->head + 1) & r->mask;
+	r->count++;
+}
+
+static inline int nvme_sw_queue_ring_of(struct nvme_ctx *ctx)
+{
+	return ctx->cmd == NVME_CMD_READ ? NVME_SW_QUEUE_RD : NVME_SW_QUEUE_WR;
+}
+
+/*
+ * nvme_sw_queue_pick - the ring whose head is the head of the queue
+ *
+ * Must only be called on a non-empty queue.
+ */
+static int nvme_sw_queue_pick(struct nvme_sw_queue *q)
+{
+	if (!q->ring[NVME_SW_QUEUE_WR].count)
+		return NVME_SW_QUEUE_RD;
+	if (!q->ring[NVME_SW_QUEUE_RD].count)
+		return NVME_SW_QUEUE_WR;
+
+	switch (nvme_rw_policy) {
+	case NVME_RW_READ_PRIORITY:
+		return NVME_SW_QUEUE_RD;
+	case NVME_RW_RATIO:
+		return q->reads_in_row < nvme_rw_ratio ? NVME_SW_QUEUE_RD : NVME_SW_QUEUE_WR;
+	default:
+		return q->served[NVME_SW_QUEUE_RD] <= q->served[NVME_SW_QUEUE_WR] ?
+			NVME_SW_QUEUE_RD : NVME_SW_QUEUE_WR;
 	}
-	q->buf[q->head] = ctx;
-   	q->head = (q->head + 1) % NVME_SW_QUEUE_SIZE; 
-    q->count++;
+}
+
+int nvme_sw_queue_push_back(struct nvme_sw_queue *q, struct nvme_ctx *ctx)
+{
+	struct nvme_sw_ring *r = &q->ring[nvme_sw_queue_ring_of(ctx)];
+
+	if (!list_empty(&r->overflow) ||
+	    (r->count == r->mask + 1 && nvme_sw_ring_grow(r)))
+		list_add_tail(&r->overflow, &ctx->link);
+	else
+		nvme_sw_ring_put(r, ctx);
+	q->count++;
 	q->total_token_demand += ctx->req_cost;
 	return 0;
 }
 
 int nvme_sw_queue_pop_front(struct nvme_sw_queue *q, struct nvme_ctx **ctx)
 {
-    if(q->count == 0){
+	struct nvme_sw_ring *r;
+	int i;
+
+	if(q->count == 0){
 		//log_info("ringbuf empty!\n");
-        return -EAGAIN;
+		return -EAGAIN;
 	}
-	*ctx = q->buf[q->tail];
-	q->total_token_demand -= q->buf[q->tail]->req_cost;
-    q->tail = (q->tail + 1) % NVME_SW_QUEUE_SIZE; 
-    q->count--;
+	i = nvme_sw_queue_pick(q);
+	r = &q->ring[i];
+	*ctx = r->buf[r->tail];
+	q->total_token_demand -= (*ctx)->req_cost;
+	r->tail = (r->tail + 1) & r->mask;
+	r->count--;
+	q->count--;
+
+	// overflowed requests are younger than everything in the ring
+	if (!list_empty(&r->overflow))
+		nvme_sw_ring_put(r, list_pop(&r->overflow, struct nvme_ctx, link));
+
+	if (i == NVME_SW_QUEUE_RD)
+		q->reads_in_row++;
+	else
+		q->reads_in_row = 0;
+
+	// only count tokens while both rings compete, so neither banks credit
+	if (r->count && q->ring[!i].count)
+		q->served[i] += (*ctx)->req_cost;
+	else
+		q->served[NVME_SW_QUEUE_RD] = q->served[NVME_SW_QUEUE_WR] = 0;
 	return 0;
 }
 
@@ -88,11 +203,25 @@ int nvme_sw_queue_isempty(struct nvme_sw_queue *q)
 
 int nvme_sw_queue_peak_head_cost(struct nvme_sw_queue *q)
 {
+	struct nvme_sw_ring *r;
+
 	if (q->count == 0)
 		return -1;
 
-	return q->buf[q->tail]->req_cost;
+	r = &q->ring[nvme_sw_queue_pick(q)];
+	return r->buf[r->tail]->req_cost;
+
+}
+
+unsigned long nvme_sw_queue_peak_head_deadline(struct nvme_sw_queue *q)
+{
+	struct nvme_sw_ring *r;
+
+	if (q->count == 0)
+		return ULONG_MAX;
 
+	r = &q->ring[nvme_sw_queue_pick(q)];
+	return r->buf[r->tail]->deadline;
 }
 
 unsigned long nvme_sw_queue_save_tokens(struct nvme_sw_queue *q, unsigned long tokens)
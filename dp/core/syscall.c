@@ -80,14 +80,20 @@
 #include <dune.h>
 
 #define UARR_MIN_CAPACITY	8192
+/* the NVMe completion vector follows the descriptors in the same mapping */
+#define UARR_CPL_OFFSET		align_up(sizeof(struct bsys_arr) + \
+					 UARR_MIN_CAPACITY * sizeof(struct bsys_desc), 64)
 
 DEFINE_PERCPU(struct bsys_arr *, usys_arr);
 DEFINE_PERCPU(void *, usys_iomap);
 DEFINE_PERCPU(unsigned long, syscall_cookie);
 DEFINE_PERCPU(unsigned long, idle_cycles);
+DEFINE_PERCPU(struct nvme_cpl_ent *, usys_nvme_cpl);
+DEFINE_PERCPU(struct nvme_cpl_ent *, usys_nvme_cpl_user);
+DEFINE_PERCPU(struct bsys_desc *, usys_nvme_cpl_desc);
 
-static const int usys_nr = div_up(sizeof(struct bsys_arr) +
-				  UARR_MIN_CAPACITY * sizeof(struct bsys_desc),
+static const int usys_nr = div_up(UARR_CPL_OFFSET +
+				  USYS_NVME_CPL_MAX * sizeof(struct nvme_cpl_ent),
 				  PGSIZE_2MB);
 
 static bsysfn_t bsys_tbl[] = {
@@ -108,7 +114,11 @@ static bsysfn_t bsys_tbl[] = {
 	(bsysfn_t) bsys_nvme_open,
 	(bsysfn_t) bsys_nvme_close,
 	(bsysfn_t) bsys_nvme_register_flow,
-	(bsysfn_t) bsys_nvme_unregister_flow
+	(bsysfn_t) bsys_nvme_unregister_flow,
+	(bsysfn_t) bsys_nvme_register_buf,
+	(bsysfn_t) bsys_nvme_trim,
+	(bsysfn_t) bsys_nvme_write_zeroes,
+	(bsysfn_t) bsys_nvme_flush
 };
 
 static int bsys_dispatch_one(struct bsys_desc __user *d)
@@ -205,6 +215,15 @@ static int sys_bpoll(struct bsys_desc __user *d, unsigned int nr)
 		eth_fg_assign_to_cpu((bitmap_ptr) percpu_get(cp_cmd)->migrate.fg_bitmap, percpu_get(cp_cmd)->migrate.cpu);
 		percpu_get(cp_cmd)->cmd_id = CP_CMD_NOP;
 		break;
+	case CP_CMD_NVME_MIGRATE:
+		/* only the thread scheduling the tenant can hand it over,
+		 * its connections move at the next quiescent state */
+		if (nvme_tenant_migrate(percpu_get(cp_cmd)->nvme_migrate.fg_handle,
+					percpu_get(cp_cmd)->nvme_migrate.cpu))
+			log_err("nvme: can't migrate tenant %ld\n", percpu_get(cp_cmd)->nvme_migrate.fg_handle);
+		percpu_get(cp_cmd)->cmd_id = CP_CMD_NOP;
+		percpu_get(cp_cmd)->status = CP_STATUS_READY;
+		break;
 	case CP_CMD_IDLE:
 		if (percpu_get(usys_arr)->len)
 			return 0;
@@ -213,6 +232,11 @@ static int sys_bpoll(struct bsys_desc __user *d, unsigned int nr)
 		break;
 	}
 
+	/* a tenant moves with its flow groups, also in a quiescent state */
+	if (nvme_rebalance_flag && !percpu_get(usys_arr)->len &&
+	    percpu_get(cp_cmd)->cmd_id == CP_CMD_NOP)
+		nvme_tenant_move_conns();
+
 	//schedule
 	if (nvme_sched_flag) {
 		nvme_sched();
@@ -451,6 +475,11 @@ int syscall_init_cpu(void)
 
 	percpu_get(usys_arr) = arr;
 	percpu_get(usys_iomap) = iomap;
+	percpu_get(usys_nvme_cpl) = (struct nvme_cpl_ent *)
+		((uintptr_t) arr + UARR_CPL_OFFSET);
+	percpu_get(usys_nvme_cpl_user) = (struct nvme_cpl_ent *)
+		((uintptr_t) iomap + UARR_CPL_OFFSET);
+	percpu_get(usys_nvme_cpl_desc) = NULL;
 	return 0;
 }
 
@@ -463,5 +492,7 @@ void syscall_exit_cpu(void)
 	page_free_contig((void *) percpu_get(usys_arr), usys_nr);
 	percpu_get(usys_arr) = NULL;
 	percpu_get(usys_iomap) = NULL;
+	percpu_get(usys_nvme_cpl) = NULL;
+	percpu_get(usys_nvme_cpl_user) = NULL;
 }
 
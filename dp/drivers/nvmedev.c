@@ -35,15 +35,22 @@
 #include <ix/syscall.h>
 #include <ix/nvmedev.h>
 #include <ix/page.h>
+#include <ix/mem.h>
 #include <ix/vm.h>
 #include <ix/mempool.h>
 #include <ix/nvme_sw_queue.h>
 #include <ix/spdk.h>
 #include <ix/atomic.h>
+#include <ix/hash.h>
+#include <ix/ethqueue.h>
+#include <ix/ethfg.h>
+#include <ix/bitmap.h>
 
 #include <spdk/nvme.h>
 #include <spdk/nvme_spec.h>
 #include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
 
 
 static struct spdk_nvme_ctrlr *nvme_ctrlr = NULL;
@@ -63,23 +70,79 @@ DEFINE_PERCPU(bool, mempool_initialized);
 
 static DEFINE_SPINLOCK(nvme_bitmap_lock);
 
+/*
+ * Flow groups are keyed by (flow_group_id, tid): the connections of an
+ * application tenant that RSS spreads over several threads form one tenant
+ * per thread, scheduled where its connections live. The index is shared so
+ * that a migrated tenant can be rehashed under its new thread; each bucket
+ * has its own lock and threads mostly look up their own keys, so they rarely
+ * contend. The free list of handles has a lock that is only held for O(1).
+ */
+#define NVME_FG_HASH_ENTRIES	4096
+#define NVME_FG_HASH_SEED	0x5ec7a2d1
+
+struct nvme_fg_bucket {
+	spinlock_t lock;
+	struct hlist_head head;
+};
+
+static struct nvme_fg_bucket nvme_fg_tbl[NVME_FG_HASH_ENTRIES];
+static DEFINE_SPINLOCK(nvme_fg_free_lock);
+static long nvme_fg_free_list[MAX_NVME_FLOW_GROUPS];
+static int nvme_fg_free_count;
+
+/*
+ * With tenant_rebalance, the connections registered in each TCP flow group
+ * and the tenant they belong to (0 if none, NVME_ETH_FG_MIXED if several),
+ * so the rebalancer can find the flow groups to move with a tenant. An entry
+ * is only updated by the thread that owns the flow group.
+ */
+#define NVME_ETH_FG_MIXED	-1
+#define NVME_HID_ETH_FG(h)	(((h) >> 48) & 0xffff)	// see tcpapi_to_handle()
+
+struct nvme_eth_fg {
+	long fg_handle;
+	int conns;
+};
+
+static struct nvme_eth_fg nvme_eth_fgs[ETH_MAX_TOTAL_FG];
+
 static struct mempool_datastore request_datastore;
 static struct mempool_datastore ctx_datastore;
 static struct mempool_datastore nvme_swq_datastore;
 
 static struct nvme_flow_group nvme_fgs[MAX_NVME_FLOW_GROUPS];
 static unsigned long global_token_rate = UINT_MAX; 				 	// max token rate device can handle for current strictest latency SLO
-static atomic_u64_t global_leftover_tokens = ATOMIC_INIT(0); 	 	// shared token bucket
 static unsigned long global_LC_sum_token_rate = 0; 	 				// LC tenant token reservation summed across all LC tenants globally
 static unsigned long global_num_best_effort_tenants = 0; 			// total num of best effort tenants
 static unsigned long global_num_lc_tenants = 0; 					// total num of latency critical tenants
-static atomic_t global_be_token_rate_per_tenant = ATOMIC_INIT(0); 	// token rate per best effort tenant
-static unsigned long global_lc_boost_no_BE = 0; 			 		// fair share of leftover tokens that LC tenant can use when no BE registered
+static unsigned long global_be_weight_sum = 0; 					// sum of be_weight over all best effort tenants
+static atomic_u64_t global_be_rate_per_weight_fp = ATOMIC_INIT(0); 	// fixed-point tokens/cycle per unit of best effort weight
+static atomic_u64_t global_lc_boost_fp = ATOMIC_INIT(0); 			// fixed-point tokens/cycle of leftover tokens that LC tenant can use when no BE registered
+static unsigned long global_num_lc_rw_tenants = 0; 				// num of latency critical tenants with writes in their SLO
+
+/*
+ * LC tenants indexed by latency SLO (binary min-heap of fg handles), so the
+ * strictest SLO is always at the top. Protected by nvme_bitmap_lock.
+ */
+static long lc_slo_heap[MAX_NVME_FLOW_GROUPS];
+static int lc_slo_heap_size = 0;
+
+/*
+ * Token pool epochs: an epoch ends once every active core has completed a
+ * scheduling round in it. The high 32 bits of the word are the epoch, the low
+ * 32 bits count the cores that have completed a round in it.
+ */
+#define NVME_EPOCH_SHIFT	32
+#define NVME_EPOCH_MASK		((1UL << NVME_EPOCH_SHIFT) - 1)
 
-#define MAX_NUM_THREADS 24
-static int scheduled_bit_vector[MAX_NUM_THREADS];
+static struct {
+	atomic_u64_t word;
+} __aligned(64) nvme_token_epoch;
+DEFINE_PERCPU(unsigned long, sched_epoch);		// last epoch this core was counted in
 
-#define TOKEN_FRAC_GIVEAWAY 0.9 
+#define TOKEN_GIVEAWAY_NUM 9		// LC tenants over POS_LIMIT donate 9/10 of their credit
+#define TOKEN_GIVEAWAY_DEN 10
 static long TOKEN_DEFICIT_LIMIT = 10000;
 static bool global_readonly_flag = true;
 
@@ -89,18 +152,138 @@ DEFINE_PERCPU(struct mempool, request_mempool __attribute__ ((aligned (64))));
 DEFINE_PERCPU(struct mempool, ctx_mempool __attribute__ ((aligned (64))));
 DEFINE_PERCPU(struct mempool, nvme_swq_mempool __attribute__ ((aligned (64))));
 DEFINE_PERCPU(int, received_nvme_completions);
+DEFINE_PERCPU(int, nvme_poll_budget);
 
 DEFINE_PERCPU(struct nvme_tenant_mgmt, nvme_tenant_manager);
+#define NVME_LC_HEAP_MIN	16		// initial LC dispatch heap slots per thread
 
-DEFINE_PERCPU(unsigned long, last_sched_time);
-DEFINE_PERCPU(unsigned long, last_sched_time_be);
+DEFINE_PERCPU(unsigned long, last_sched_tsc);
+DEFINE_PERCPU(unsigned long, be_token_frac);
+DEFINE_PERCPU(unsigned long, local_token_bucket);
+
+/*
+ * Hierarchical token exchange
+ *
+ * Spare tokens go into the core's local bucket, spill into its socket's pool
+ * when the bucket overflows, and into the global pool when the socket pool
+ * overflows. A core short of tokens draws from its local bucket, then its
+ * socket pool, then the global pool. Grants between levels are batched, so
+ * the shared cache lines are touched about once per batch rather than on
+ * every scheduling round.
+ */
+#define NVME_MAX_SOCKETS			8
+#define NVME_TOKEN_BATCH_REQS		16		// grant batch in worst-case (4KB write) requests
+#define NVME_SOCKET_POOL_BATCHES	8		// socket pool spills to global past this many batches
+
+struct nvme_token_pool {
+	atomic64_t tokens;		// may dip below 0 while a short grant is returned
+	long stale;				// level left at the last epoch end, expires at the next
+} __aligned(64);
+
+static struct nvme_token_pool nvme_socket_pool[NVME_MAX_SOCKETS];
+static struct nvme_token_pool nvme_global_pool;
+static unsigned long nvme_token_batch = 1;
 DEFINE_PERCPU(unsigned long, local_extra_demand);
 DEFINE_PERCPU(unsigned long, local_leftover_tokens);
-DEFINE_PERCPU(int, roundrobin_start);
+
+/*
+ * Requests are queued and completed on the thread their connection lives on,
+ * except for requests another thread stole and, with tenant_rebalance, for
+ * requests still submitted on the old thread of a migrated tenant. Those are
+ * handed to the scheduling thread through its reqs list, and completions are
+ * handed to the thread that delivers the events through its done list.
+ */
+struct nvme_handoff {
+	spinlock_t lock;
+	struct list_head reqs;			// requests to queue in this thread's swqs
+	struct list_head done;			// completions to deliver on this thread
+} __aligned(64);
+
+static struct nvme_handoff nvme_handoff[NCPU];
+
+/*
+ * Tenant rebalancing: every NVME_REBALANCE_MS, each thread publishes the
+ * tokens its tenants were scheduled, and a thread whose load is more than
+ * NVME_REBALANCE_IMBALANCE percent above the average hands one tenant to the
+ * least loaded thread, together with the TCP flow groups of its connections.
+ * Only tenants that own their flow groups outright can move: a flow group
+ * shared with another tenant's connections would drag that tenant along.
+ */
+#define NVME_REBALANCE_MS			100
+#define NVME_REBALANCE_IMBALANCE	25		// % above average before moving a tenant
+#define NVME_REBALANCE_COOLDOWN		5		// intervals to wait after a migration
+
+struct nvme_core_load {
+	unsigned long load;				// smoothed tokens scheduled per interval
+} __aligned(64);
+
+static struct nvme_core_load nvme_core_load[NCPU];
+DEFINE_PERCPU(unsigned long, last_rebalance_tsc);
+DEFINE_PERCPU(int, rebalance_cooldown);
+
+/*
+ * Work stealing: a thread whose loop is slow (busy with network processing)
+ * leaves the requests its scheduler found token-eligible in its ready list
+ * until it polls for completions, and threads with idle loops and spare qpair
+ * slots submit them on their own qpair meanwhile. Tokens are charged by the
+ * scheduling thread as usual, and completions reach the submitting thread
+ * through the handoff lists.
+ */
+#define NVME_STEAL_LOOP_US			20		// loops slower than this defer to thieves
+#define NVME_STEAL_BATCH			16		// max requests taken from a thread at once
+
+struct nvme_steal_queue {
+	spinlock_t lock;
+	struct list_head ready;			// charged requests waiting to be submitted
+	int count;
+} __aligned(64);
+
+static struct nvme_steal_queue nvme_steal_q[NCPU];
+DEFINE_PERCPU(bool, nvme_loaded);				// defer submissions to thieves this round
+DEFINE_PERCPU(int, nvme_outstanding);			// commands submitted on this thread's qpair
+
+/*
+ * Queue-depth governor: caps the commands outstanding on each thread's qpair
+ * and on the device, so excess work waits in the software queues where the
+ * scheduler can still order it. The per-thread limit follows AIMD on the
+ * average completion latency: it is cut by a quarter when a window of
+ * completions is slower than the target, and grows by one when the limit
+ * held work back and latency was on target.
+ */
+#define NVME_QD_MIN				4
+#define NVME_QD_MAX				256		// per-thread ceiling
+#define NVME_DEV_QD_MAX			1024	// device-wide ceiling
+#define NVME_QD_WINDOW			64		// completions per AIMD decision
+#define NVME_QD_TARGET_US		1000	// latency target without LC tenants
+
+struct nvme_qd_governor {
+	int limit;
+	int window_completions;
+	unsigned long window_lat;		// completion latency summed over the window
+	bool limited;					// the limit held work back in this window
+	struct list_head retry;			// commands the qpair had no room for
+};
+
+static DEFINE_PERCPU(struct nvme_qd_governor, nvme_qd);
+static atomic_t nvme_dev_inflight = ATOMIC_INIT(0);
 
 static int nvme_compute_req_cost(int req_type, size_t req_len);
+static void nvme_init_cost_table(void);
+static void nvme_build_cost_table(void);
+static int nvme_sched_enqueue(struct nvme_sw_queue *swq, struct nvme_ctx *ctx);
 
 static void set_token_deficit_limit(void);
+static void nvme_devmodel_init(void);
+static void nvme_devmodel_record(struct nvme_ctx *ctx);
+static void nvme_devmodel_tick(void);
+static void nvme_profile_complete(struct nvme_ctx *ctx);
+static void nvme_complete_req(struct nvme_ctx *ctx, long ret);
+static inline void nvme_inflight_inc(void);
+static void nvme_qd_complete(struct nvme_ctx *ctx);
+static int nvme_lc_heap_reserve(struct nvme_tenant_mgmt *mgr);
+static void nvme_tenant_attach(struct nvme_tenant_mgmt *mgr, struct nvme_flow_group *fg);
+static void nvme_tenant_release(void *data);
+static bool nvme_profiling = false;
 
 struct nvme_request * alloc_local_nvme_request(struct nvme_request **req)
 {
@@ -133,6 +316,7 @@ struct nvme_sw_queue * alloc_local_nvme_swq(void)
 
 void free_local_nvme_swq(struct nvme_sw_queue *q)
 {
+	nvme_sw_queue_destroy(q);
 	mempool_free(&percpu_get(nvme_swq_mempool),q);
 }
 /**
@@ -143,6 +327,7 @@ void free_local_nvme_swq(struct nvme_sw_queue *q)
 int init_nvme_request_cpu(void)
 {
 	struct nvme_tenant_mgmt* thread_tenant_manager;
+	struct nvme_handoff *handoff;
 	struct mempool *m = &percpu_get(request_mempool);
 	int ret;
 
@@ -178,12 +363,39 @@ int init_nvme_request_cpu(void)
 	}
 	
 	thread_tenant_manager = &percpu_get(nvme_tenant_manager);
-	list_head_init(&thread_tenant_manager->tenant_swq);
+	list_head_init(&thread_tenant_manager->lc_swq);
+	list_head_init(&thread_tenant_manager->be_swq);
+	list_head_init(&thread_tenant_manager->be_active);
 	thread_tenant_manager->num_tenants = 0;
 	thread_tenant_manager->num_best_effort_tenants = 0;
-
-	percpu_get(last_sched_time) = timer_now();
-	percpu_get(last_sched_time_be) = rdtsc(); //timer_now();
+	thread_tenant_manager->be_weight_sum = 0;
+	thread_tenant_manager->lc_edf_heap = NULL;
+	thread_tenant_manager->lc_edf_cap = 0;
+
+	handoff = &nvme_handoff[percpu_get(cpu_nr)];
+	spin_lock_init(&handoff->lock);
+	list_head_init(&handoff->reqs);
+	list_head_init(&handoff->done);
+
+	spin_lock_init(&nvme_steal_q[percpu_get(cpu_nr)].lock);
+	list_head_init(&nvme_steal_q[percpu_get(cpu_nr)].ready);
+	nvme_steal_q[percpu_get(cpu_nr)].count = 0;
+	percpu_get(nvme_loaded) = false;
+	percpu_get(nvme_outstanding) = 0;
+	percpu_get(nvme_qd).limit = NVME_QD_MAX;
+	percpu_get(nvme_qd).window_completions = 0;
+	percpu_get(nvme_qd).window_lat = 0;
+	percpu_get(nvme_qd).limited = false;
+	list_head_init(&percpu_get(nvme_qd).retry);
+
+	percpu_get(nvme_poll_budget) = eth_rx_max_batch;
+
+	percpu_get(last_sched_tsc) = rdtsc();
+	percpu_get(last_rebalance_tsc) = percpu_get(last_sched_tsc);
+	percpu_get(rebalance_cooldown) = 0;
+	percpu_get(be_token_frac) = 0;
+	percpu_get(local_token_bucket) = 0;
+	percpu_get(sched_epoch) = ULONG_MAX;
 	percpu_get(local_leftover_tokens) = 0;
 	percpu_get(local_extra_demand) = 0;
 	percpu_get(mempool_initialized) = true;
@@ -196,7 +408,7 @@ int init_nvme_request_cpu(void)
  */
 int init_nvme_request(void)
 {
-	int ret;
+	int ret, i;
 	struct mempool_datastore *m = &request_datastore;
 	struct mempool_datastore *m2 = &ctx_datastore;
 	struct mempool_datastore *m3 = &nvme_swq_datastore;
@@ -235,10 +447,22 @@ int init_nvme_request(void)
 		return ret;
 	}
 
+	// handle 0 is never handed out
+	bitmap_init(nvme_fgs_bitmap, MAX_NVME_FLOW_GROUPS, 0);
+	for (i = MAX_NVME_FLOW_GROUPS - 1; i > 0; i--)
+		nvme_fg_free_list[nvme_fg_free_count++] = i;
+	for (i = 0; i < NVME_FG_HASH_ENTRIES; i++)
+		spin_lock_init(&nvme_fg_tbl[i].lock);
+
 	//need to alloc req mempool for admin queue
 	init_nvme_request_cpu();
 
+	nvme_init_cost_table();
 	set_token_deficit_limit();
+	log_info("DEVICE PARAMS: read cost %d, write cost %d\n", NVME_READ_COST, NVME_WRITE_COST);
+	log_info("DEVICE PARAMS: trim cost %d, flush cost %d, write zeroes cost %d\n",
+			 NVME_TRIM_COST, NVME_FLUSH_COST, NVME_WRITE_ZEROES_COST);
+	nvme_devmodel_init();
 	
 	return 0;
 }
@@ -248,6 +472,7 @@ int init_nvme_request(void)
  */
 void nvme_request_exit_cpu(void)
 {
+	free(percpu_get(nvme_tenant_manager).lc_edf_heap);
 	mempool_pagemem_destroy(&request_datastore);
 	mempool_pagemem_destroy(&ctx_datastore);
 	mempool_pagemem_destroy(&nvme_swq_datastore);
@@ -467,6 +692,7 @@ nvme_write_cb(void *ctx, const struct spdk_nvme_cpl *cpl)
 {
 	struct nvme_ctx *n_ctx = (struct nvme_ctx *) ctx;
 
+	nvme_qd_complete(n_ctx);
 	if (spdk_nvme_cpl_is_error(cpl)){
 		log_info("SPDK Write Failed!\n");
 		log_info("%s (%02x/%02x) sqid:%d cid:%d cdw0:%x sqhd:%04x p:%x m:%x dnr:%x\n",
@@ -475,9 +701,15 @@ nvme_write_cb(void *ctx, const struct spdk_nvme_cpl *cpl)
 		       cpl->sqhd, cpl->status.p, cpl->status.m, cpl->status.dnr);
 	}
 
-	usys_nvme_written(n_ctx->cookie, RET_OK);
-	
-	free_local_nvme_ctx(n_ctx);
+	if (unlikely(nvme_profiling)) {
+		nvme_profile_complete(n_ctx);
+		return;
+	}
+
+	if (nvme_devmodel_online)
+		nvme_devmodel_record(n_ctx);
+
+	nvme_complete_req(n_ctx, RET_OK);
 }
 
 void
@@ -485,6 +717,7 @@ nvme_read_cb(void *ctx, const struct spdk_nvme_cpl *cpl)
 {
 	struct nvme_ctx *n_ctx = (struct nvme_ctx *) ctx;
 
+	nvme_qd_complete(n_ctx);
 	if (spdk_nvme_cpl_is_error(cpl)){
 		log_info("SPDK Read Failed!\n");
 		log_info("%s (%02x/%02x) sqid:%d cid:%d cdw0:%x sqhd:%04x p:%x m:%x dnr:%x\n",
@@ -493,9 +726,15 @@ nvme_read_cb(void *ctx, const struct spdk_nvme_cpl *cpl)
 		       cpl->sqhd, cpl->status.p, cpl->status.m, cpl->status.dnr);
 	}
 	
-	usys_nvme_response(n_ctx->cookie, n_ctx->user_buf.buf, RET_OK);
-	
-	free_local_nvme_ctx(n_ctx);
+	if (unlikely(nvme_profiling)) {
+		nvme_profile_complete(n_ctx);
+		return;
+	}
+
+	if (nvme_devmodel_online)
+		nvme_devmodel_record(n_ctx);
+
+	nvme_complete_req(n_ctx, RET_OK);
 }
 
 long bsys_nvme_open(long dev_id, long ns_id)
@@ -515,8 +754,6 @@ long bsys_nvme_open(long dev_id, long ns_id)
 	if (ioq < 0){
 		return -RET_NOBUFS; 
 	}
-	bitmap_init(nvme_fgs_bitmap, MAX_NVME_FLOW_GROUPS, 0);
-
 	percpu_get(open_ev[percpu_get(open_ev_ptr)++]) = ioq;
 	ns = spdk_nvme_ctrlr_get_ns(nvme_ctrlr, ns_id);
 	global_ns_size = spdk_nvme_ns_get_size(ns);
@@ -539,45 +776,97 @@ long bsys_nvme_close(long dev_id, long ns_id, hqu_t handle)
 	return RET_OK;
 }
 
+static struct nvme_fg_bucket *nvme_fg_bucket(long flow_group_id, unsigned int tid)
+{
+	int idx = hash_crc32c_one(NVME_FG_HASH_SEED ^ tid, flow_group_id);
+	idx &= NVME_FG_HASH_ENTRIES - 1;
+
+	return &nvme_fg_tbl[idx];
+}
+
+/*
+ * nvme_fg_lock - locks the bucket of a registered flow group
+ *
+ * A migration may rehash the flow group under another thread until its
+ * bucket lock is held, so the bucket is checked again once locked.
+ */
+static struct nvme_fg_bucket *nvme_fg_lock(struct nvme_flow_group *fg)
+{
+	struct nvme_fg_bucket *b;
+	unsigned int tid;
+
+	for (;;) {
+		tid = *(volatile unsigned int *) &fg->tid;
+		b = nvme_fg_bucket(fg->flow_group_id, tid);
+		spin_lock(&b->lock);
+		if (fg->tid == tid)
+			return b;
+		spin_unlock(&b->lock);
+	}
+}
+
+static void nvme_fg_free_handle(long fg_handle)
+{
+	spin_lock(&nvme_fg_free_lock);
+	nvme_fg_free_list[nvme_fg_free_count++] = fg_handle;
+	spin_unlock(&nvme_fg_free_lock);
+}
+
+/**
+ * set_nvme_flow_group_id - finds or allocates the handle of a flow group
+ * @flow_group_id: the flow group id picked by the application
+ * @fg_handle_to_set: a pointer to store the handle
+ *
+ * Returns 1 if the flow group is already registered, 0 if a new handle was
+ * allocated, or -ENOMEM if all handles are in use. Only flow groups scheduled
+ * by the calling thread match. The caller must hold the lock of the bucket of
+ * (flow_group_id, calling thread).
+ */
 int set_nvme_flow_group_id(long flow_group_id, long* fg_handle_to_set)
 {
-	int i;
-    int next_avail = 0;
-	// first check if already registered this flow	
-	spin_lock(&nvme_bitmap_lock);	
-	for (i = 1; i < MAX_NVME_FLOW_GROUPS; i++) {
-		if (bitmap_test(nvme_fgs_bitmap, i)){
-			// if already registered this flow group, return its index
-			if (nvme_fgs[i].flow_group_id == flow_group_id &&
-				nvme_fgs[i].tid == percpu_get(cpu_nr)){
-				*fg_handle_to_set = i;
-    			spin_unlock(&nvme_bitmap_lock);	
-				return 1;
-			}
-		}
-		else {
-			if (next_avail == 0){
-				next_avail = i;
-			}	
+	unsigned int tid = percpu_get(cpu_nr);
+	struct hlist_head *h = &nvme_fg_bucket(flow_group_id, tid)->head;
+	struct hlist_node *pos;
+	struct nvme_flow_group *fg;
+	long fg_handle = 0;
+
+	hlist_for_each(h, pos) {
+		fg = hlist_entry(pos, struct nvme_flow_group, link);
+		if (fg->flow_group_id == flow_group_id && fg->tid == tid) {
+			*fg_handle_to_set = fg - nvme_fgs;
+			return 1;
 		}
 	}
 
-	if (next_avail == MAX_NVME_FLOW_GROUPS) {
-    	spin_unlock(&nvme_bitmap_lock);	
+	spin_lock(&nvme_fg_free_lock);
+	if (nvme_fg_free_count)
+		fg_handle = nvme_fg_free_list[--nvme_fg_free_count];
+	spin_unlock(&nvme_fg_free_lock);
+	if (!fg_handle)
 		return -ENOMEM;
-	}
-	
-	bitmap_set(nvme_fgs_bitmap, next_avail);
-    spin_unlock(&nvme_bitmap_lock);	
-	
-	*fg_handle_to_set = next_avail;
+
+	fg = &nvme_fgs[fg_handle];
+	fg->flow_group_id = flow_group_id;
+	fg->tid = tid;
+	fg->migrating = false;
+	hlist_add_head(h, &fg->link);
+
+	*fg_handle_to_set = fg_handle;
 	return 0;
 }
 
+/* called with the bucket lock of the flow group held */
+static void release_nvme_flow_group_id(long fg_handle)
+{
+	hlist_del(&nvme_fgs[fg_handle].link);
+	nvme_fg_free_handle(fg_handle);
+}
+
 // adjust token deficit limit to allow LC tenants to burst, but not too much
 static void set_token_deficit_limit(void){
-	log_info("DEVICE PARAMS: read cost %d, write cost %d\n", NVME_READ_COST, NVME_WRITE_COST);
 	TOKEN_DEFICIT_LIMIT = 100*NVME_WRITE_COST; 
+	// token pool grants scale with request cost too
+	nvme_token_batch = max(NVME_TOKEN_BATCH_REQS * NVME_WRITE_COST, 1);
 }
 
 
@@ -664,51 +953,163 @@ unsigned long scaled_IOPS(unsigned long IOPS, int rw_ratio_100){
 	return (unsigned long) (scaledIOPS + 0.5);
 }
 
-static void readjust_lc_tenant_token_limits(void){
-	int i,j = 0;
-	for (i = 0; i < MAX_NVME_FLOW_GROUPS; i++){
-		if (bitmap_test(nvme_fgs_bitmap, i)) {
-			if (nvme_fgs[i].latency_critical_flag) {
-				nvme_fgs[i].scaled_IOPuS_limit = (nvme_fgs[i].scaled_IOPS_limit + global_lc_boost_no_BE) / (double) 1E6;
-				j++;
-				if (j == global_num_lc_tenants){
-					return;
-				}
-			}
-		}
+static inline unsigned int lc_slo_heap_key(int pos)
+{
+	return nvme_fgs[lc_slo_heap[pos]].latency_us_SLO;
+}
+
+static inline void lc_slo_heap_set(int pos, long fg_handle)
+{
+	lc_slo_heap[pos] = fg_handle;
+	nvme_fgs[fg_handle].lc_heap_idx = pos;
+}
+
+static void lc_slo_heap_sift_up(int pos)
+{
+	long fg_handle = lc_slo_heap[pos];
+	unsigned int key = nvme_fgs[fg_handle].latency_us_SLO;
+
+	while (pos > 0 && lc_slo_heap_key((pos - 1) / 2) > key) {
+		lc_slo_heap_set(pos, lc_slo_heap[(pos - 1) / 2]);
+		pos = (pos - 1) / 2;
+	}
+	lc_slo_heap_set(pos, fg_handle);
+}
+
+static void lc_slo_heap_sift_down(int pos)
+{
+	long fg_handle = lc_slo_heap[pos];
+	unsigned int key = nvme_fgs[fg_handle].latency_us_SLO;
+	int child;
+
+	while ((child = 2 * pos + 1) < lc_slo_heap_size) {
+		if (child + 1 < lc_slo_heap_size &&
+		    lc_slo_heap_key(child + 1) < lc_slo_heap_key(child))
+			child++;
+		if (lc_slo_heap_key(child) >= key)
+			break;
+		lc_slo_heap_set(pos, lc_slo_heap[child]);
+		pos = child;
 	}
+	lc_slo_heap_set(pos, fg_handle);
+}
+
+static void lc_slo_heap_insert(long fg_handle)
+{
+	lc_slo_heap_set(lc_slo_heap_size++, fg_handle);
+	lc_slo_heap_sift_up(lc_slo_heap_size - 1);
+}
+
+static void lc_slo_heap_remove(long fg_handle)
+{
+	int pos = nvme_fgs[fg_handle].lc_heap_idx;
+
+	lc_slo_heap_size--;
+	if (pos == lc_slo_heap_size)
+		return;
+
+	lc_slo_heap_set(pos, lc_slo_heap[lc_slo_heap_size]);
+	if (pos > 0 && lc_slo_heap_key(pos) < lc_slo_heap_key((pos - 1) / 2))
+		lc_slo_heap_sift_up(pos);
+	else
+		lc_slo_heap_sift_down(pos);
+}
+
+static unsigned int strictest_lc_latency_SLO(void)
+{
+	if (!lc_slo_heap_size)
+		return UINT_MAX;
+	return lc_slo_heap_key(0);
+}
+
+static void update_readonly_flag(void)
+{
+	// assume BE tenants have rd/wr mixed workloads
+	global_readonly_flag = !global_num_lc_rw_tenants && !global_num_best_effort_tenants;
+}
+
+/*
+ * Token rates are kept as fixed-point tokens per TSC cycle with
+ * NVME_TOKEN_FP_SHIFT fractional bits. Whoever earns tokens carries the
+ * fractional part over to its next round, so no tokens are lost to rounding
+ * however long a tenant runs.
+ */
+#define NVME_TOKEN_FP_SHIFT		32
+#define NVME_TOKEN_FP_MASK		((1UL << NVME_TOKEN_FP_SHIFT) - 1)
+
+static inline unsigned long nvme_token_rate_fp(unsigned long tokens_per_sec)
+{
+	return (unsigned long) (((unsigned __int128) tokens_per_sec << NVME_TOKEN_FP_SHIFT) 
+							/ (cycles_per_us * 1000000UL));
+}
+
+static inline unsigned long nvme_tokens_earned(unsigned long rate_fp, unsigned long cycles,
+											   unsigned long *frac)
+{
+	unsigned __int128 acc = (unsigned __int128) rate_fp * cycles + *frac;
 
+	*frac = (unsigned long) acc & NVME_TOKEN_FP_MASK;
+	return (unsigned long) (acc >> NVME_TOKEN_FP_SHIFT);
 }
 
+/*
+ * publish_token_rates - recompute the BE share and LC boost and publish them
+ * to the per-thread schedulers, which read them without taking any lock
+ */
+static void publish_token_rates(void)
+{
+	unsigned long be_token_rate_per_weight = 0;
+	unsigned long lc_token_rate_boost_when_no_BE = 0;
+	unsigned long spare_token_rate = 0;
+
+	// the device model can shrink below the LC reservations at runtime
+	if (global_token_rate > global_LC_sum_token_rate)
+		spare_token_rate = global_token_rate - global_LC_sum_token_rate;
+
+	if (global_num_best_effort_tenants){
+		// spare tokens are split among BE tenants in proportion to their weight
+	   	be_token_rate_per_weight = spare_token_rate / global_be_weight_sum;
+	}
+	else if (global_num_lc_tenants){
+		// only boost LC tenants if no BE tenants registered
+		lc_token_rate_boost_when_no_BE = spare_token_rate / global_num_lc_tenants;
+	}
+	atomic_u64_write(&global_be_rate_per_weight_fp, nvme_token_rate_fp(be_token_rate_per_weight));
+	atomic_u64_write(&global_lc_boost_fp, nvme_token_rate_fp(lc_token_rate_boost_when_no_BE));
+}
 
 int recalculate_weights_add(long new_flow_group_idx){
+	struct nvme_flow_group *fg = &nvme_fgs[new_flow_group_idx];
 	unsigned long new_global_token_rate = 0;
 	unsigned long new_global_LC_sum_token_rate = 0;
-	unsigned long lc_token_rate_boost_when_no_BE = 0;
-	unsigned int be_token_rate_per_tenant;
-
+	unsigned int strictest_latency_SLO;
 
 	spin_lock(&nvme_bitmap_lock);	
 	
-	if (nvme_fgs[new_flow_group_idx].latency_critical_flag) {
-		new_global_LC_sum_token_rate = global_LC_sum_token_rate + nvme_fgs[new_flow_group_idx].scaled_IOPS_limit;
-		if (nvme_fgs[new_flow_group_idx].rw_ratio_SLO < 100){
-			global_readonly_flag = false;
+	if (fg->latency_critical_flag) {
+		new_global_LC_sum_token_rate = global_LC_sum_token_rate + fg->scaled_IOPS_limit;
+		if (fg->rw_ratio_SLO < 100){
+			global_num_lc_rw_tenants++;
+			update_readonly_flag();
 		}
 		
-		new_global_token_rate = lookup_device_token_rate(nvme_fgs[new_flow_group_idx].latency_us_SLO);
-		if (new_global_token_rate > global_token_rate){
-			new_global_token_rate = global_token_rate; // keep limit based on strictest latency SLO
-		}
+		// keep limit based on strictest latency SLO
+		strictest_latency_SLO = min(strictest_lc_latency_SLO(), fg->latency_us_SLO);
+		new_global_token_rate = lookup_device_token_rate(strictest_latency_SLO);
 		
 		if (new_global_LC_sum_token_rate > new_global_token_rate){
 			// control plane notifies tenant can't meet its SLO
 			// don't update the global token rate since won't regsiter this tenant
 			log_err("CANNOT SATISFY TENANT's SLO: %lu > %lu\n", new_global_LC_sum_token_rate, new_global_token_rate);
+			if (fg->rw_ratio_SLO < 100){
+				global_num_lc_rw_tenants--;
+				update_readonly_flag();
+			}
 			spin_unlock(&nvme_bitmap_lock);	
 			return -RET_CANTMEETSLO;
 		}
 	
+		lc_slo_heap_insert(new_flow_group_idx);
 		global_token_rate = new_global_token_rate;
 		global_LC_sum_token_rate = new_global_LC_sum_token_rate;
 		log_info("Global token rate: %lu tokens/s.\n", global_token_rate);
@@ -716,228 +1117,680 @@ int recalculate_weights_add(long new_flow_group_idx){
 	}
 	else{
 		global_num_best_effort_tenants++;
-		global_readonly_flag = false; // assume BE tenant has rd/wr mixed workload
+		global_be_weight_sum += fg->be_weight;
+		update_readonly_flag();
+		if (lc_slo_heap_size)
+			global_token_rate = lookup_device_token_rate(strictest_lc_latency_SLO());
 	}	
-	
-	if (global_num_best_effort_tenants){
-	   	be_token_rate_per_tenant = (global_token_rate - global_LC_sum_token_rate) / global_num_best_effort_tenants;
-		lc_token_rate_boost_when_no_BE = 0;
-	}
-	else{
-		be_token_rate_per_tenant = 0;
-		if (global_num_lc_tenants)
-			lc_token_rate_boost_when_no_BE = (global_token_rate - global_LC_sum_token_rate) / global_num_lc_tenants;
-	}
-	atomic_write(&global_be_token_rate_per_tenant, be_token_rate_per_tenant);
-	
-	// if number of BE tenants has changes from 0 to 1 or more (or vice versa)
-	// adjust LC tenant boost (only want to boost if no BE tenants registered)
-	if (lc_token_rate_boost_when_no_BE != global_lc_boost_no_BE){
-		global_lc_boost_no_BE = lc_token_rate_boost_when_no_BE;
-		readjust_lc_tenant_token_limits();
-	}
+	bitmap_set(nvme_fgs_bitmap, new_flow_group_idx);
+
+	publish_token_rates();
 	spin_unlock(&nvme_bitmap_lock);	
 	
 	return 1;
 }
 
 int recalculate_weights_remove(long flow_group_idx){
-	long i;
-	unsigned int strictest_latency_SLO = UINT_MAX;
-	unsigned int be_token_rate_per_tenant;
-	unsigned long lc_token_rate_boost_when_no_BE = 0;
-
+	struct nvme_flow_group *fg = &nvme_fgs[flow_group_idx];
 
 	spin_lock(&nvme_bitmap_lock);	
+	bitmap_clear(nvme_fgs_bitmap, flow_group_idx);
 
-	if (nvme_fgs[flow_group_idx].latency_critical_flag) {
-		//find new strictest latency SLO
-		global_readonly_flag = true;
-		for (i = 0; i < MAX_NVME_FLOW_GROUPS; i++){
-			if (bitmap_test(nvme_fgs_bitmap, i) && i != flow_group_idx) {
-				if (nvme_fgs[i].latency_critical_flag) {
-					if(nvme_fgs[i].latency_us_SLO < strictest_latency_SLO){
-						strictest_latency_SLO = nvme_fgs[i].latency_us_SLO;
-					}
-					if(nvme_fgs[i].rw_ratio_SLO < 100){
-						global_readonly_flag = false;
-					}
-				}
-			}
-		}
-		global_LC_sum_token_rate -= nvme_fgs[flow_group_idx].scaled_IOPS_limit;
-		global_token_rate = lookup_device_token_rate(strictest_latency_SLO);
-		
-		log_info("Global token rate: %lu tokens/s\n", global_token_rate);
-
+	if (fg->latency_critical_flag) {
+		lc_slo_heap_remove(flow_group_idx);
+		if (fg->rw_ratio_SLO < 100)
+			global_num_lc_rw_tenants--;
+		global_LC_sum_token_rate -= fg->scaled_IOPS_limit;
 		global_num_lc_tenants--;
 	}
 	else{
 		global_num_best_effort_tenants--;
+		global_be_weight_sum -= fg->be_weight;
 	}	
-	
-	if (global_num_best_effort_tenants){
-		global_readonly_flag = false;
-	   	be_token_rate_per_tenant = (global_token_rate - global_LC_sum_token_rate) / global_num_best_effort_tenants;
-		lc_token_rate_boost_when_no_BE = 0;
+	update_readonly_flag();
+	if (fg->latency_critical_flag || lc_slo_heap_size) {
+		global_token_rate = lookup_device_token_rate(strictest_lc_latency_SLO());
+		log_info("Global token rate: %lu tokens/s\n", global_token_rate);
 	}
-	else{
-		be_token_rate_per_tenant = 0;
-		if (global_num_lc_tenants)
-			lc_token_rate_boost_when_no_BE = (global_token_rate - global_LC_sum_token_rate) / global_num_lc_tenants;
+
+	publish_token_rates();
+	spin_unlock(&nvme_bitmap_lock);	
+
+	return 1;
+}
+
+/*
+ * recalculate_weights_resize - move a latency-critical tenant to a new SLO,
+ * re-reserving only the difference against the global token rate; the
+ * tenant keeps its old SLO if the new one can't be met
+ */
+int recalculate_weights_resize(long flow_group_idx, unsigned int latency_us_SLO,
+							   unsigned long IOPS_SLO, int rw_ratio_SLO){
+	struct nvme_flow_group *fg = &nvme_fgs[flow_group_idx];
+	unsigned long scaled_IOPS_limit = scaled_IOPS(IOPS_SLO, rw_ratio_SLO);
+	unsigned long new_global_token_rate;
+	unsigned long new_global_LC_sum_token_rate;
+
+	spin_lock(&nvme_bitmap_lock);
+
+	new_global_LC_sum_token_rate = global_LC_sum_token_rate - fg->scaled_IOPS_limit 
+		+ scaled_IOPS_limit;
+	lc_slo_heap_remove(flow_group_idx);
+	new_global_token_rate = lookup_device_token_rate(min(strictest_lc_latency_SLO(), 
+														 latency_us_SLO));
+	if (new_global_LC_sum_token_rate > new_global_token_rate){
+		log_err("CANNOT SATISFY TENANT's SLO: %lu > %lu\n", new_global_LC_sum_token_rate, new_global_token_rate);
+		lc_slo_heap_insert(flow_group_idx);
+		spin_unlock(&nvme_bitmap_lock);
+		return -RET_CANTMEETSLO;
 	}
-	atomic_write(&global_be_token_rate_per_tenant, be_token_rate_per_tenant);
 
-	// if number of BE tenants has changes from 0 to 1 or more (or vice versa)
-	// adjust LC tenant boost (only want to boost if no BE tenants registered)
-	if (lc_token_rate_boost_when_no_BE != global_lc_boost_no_BE){
-		global_lc_boost_no_BE = lc_token_rate_boost_when_no_BE;
-		readjust_lc_tenant_token_limits();
+	if ((fg->rw_ratio_SLO < 100) != (rw_ratio_SLO < 100)){
+		if (rw_ratio_SLO < 100)
+			global_num_lc_rw_tenants++;
+		else
+			global_num_lc_rw_tenants--;
+		update_readonly_flag();
 	}
+	fg->latency_us_SLO = latency_us_SLO;
+	fg->IOPS_SLO = IOPS_SLO;
+	fg->rw_ratio_SLO = rw_ratio_SLO;
+	fg->scaled_IOPS_limit = scaled_IOPS_limit;
+	// read by the scheduling thread without a lock
+	*(volatile unsigned long *) &fg->token_rate_fp = nvme_token_rate_fp(scaled_IOPS_limit);
+	lc_slo_heap_insert(flow_group_idx);
 
-	spin_unlock(&nvme_bitmap_lock);	
+	global_token_rate = new_global_token_rate;
+	global_LC_sum_token_rate = new_global_LC_sum_token_rate;
+	log_info("Global token rate: %lu tokens/s.\n", global_token_rate);
+
+	publish_token_rates();
+	spin_unlock(&nvme_bitmap_lock);
 
 	return 1;
 }
 
 
-//TODO: consider implementing separate per-thread lists for BE and LC tenants (will simplify some code for scheduler)
-long bsys_nvme_register_flow(long flow_group_id, unsigned long cookie, 
-							 unsigned int latency_us_SLO, unsigned long IOPS_SLO, 
-							 int rw_ratio_SLO  )
-{
-	long fg_handle = 0;
-	struct nvme_flow_group* nvme_fg;
-	int ret = 0;
-	int already_registered_flow = 0;
-	struct nvme_tenant_mgmt* thread_tenant_manager;
-	struct nvme_sw_queue* swq;
+/*
+ * Online device model calibration
+ *
+ * The token limits in the devmodel file are profiled offline, but the device
+ * drifts as it ages, fills up and garbage collects. When online_calibration
+ * is enabled, every thread measures the completion latency of its reads and
+ * the 4KB units it completes, and periodically folds them into a shared
+ * window. At the end of each window the p95 read latency is recorded against
+ * the weighted load (tokens/s) in an online latency vs. load curve, and the
+ * dev_model token limits are walked towards the load at which their p95
+ * limit is crossed. Mixed windows close to the strictest SLO are also used
+ * to re-fit the write cost.
+ */
+#define DEVMODEL_LAT_BUCKET_US		10		// histogram resolution
+#define DEVMODEL_LAT_BUCKETS		1024	// histogram covers ~10ms
+#define DEVMODEL_FLUSHES_PER_WINDOW	4		// local flushes per shared window
+#define DEVMODEL_MIN_SAMPLES		512		// reads needed for a meaningful p95
+#define DEVMODEL_CURVE_BINS			64
+#define DEVMODEL_CURVE_TTL			600		// windows before a curve point goes stale
+#define DEVMODEL_STEP_DOWN			20		// lower a limit by at most 1/20 per window
+#define DEVMODEL_STEP_UP			100		// probe a limit upwards by 1/100 per window
+#define DEVMODEL_HEADROOM			0.8		// probe up only if p95 < 80% of the limit
+#define DEVMODEL_FIT_BAND			0.15	// windows within 15% of the reference latency
+#define DEVMODEL_FIT_DECAY			0.98
+#define DEVMODEL_FIT_MIN_POINTS		16
+
+struct nvme_devmodel_window {
+	unsigned long start;						// tsc at start of window
+	unsigned long rd_units;						// 4KB read units completed
+	unsigned long wr_units;						// 4KB write units completed
+	unsigned long samples;						// reads in hist
+	unsigned int hist[DEVMODEL_LAT_BUCKETS];	// read latency histogram
+};
 
-	already_registered_flow = set_nvme_flow_group_id(flow_group_id, &fg_handle);
-   	if (fg_handle < 0 ){
-		log_err("error: exceeded max (%d) nvme flow groups!\n", MAX_NVME_FLOW_GROUPS);
-	}
+struct nvme_devmodel_point {
+	double p95;									// smoothed p95 read latency in us
+	unsigned long epoch;						// window that last updated the point
+};
 
-	nvme_fg = &nvme_fgs[fg_handle];
-	
-	nvme_fg->flow_group_id = flow_group_id;
-	nvme_fg->cookie = cookie;
-	nvme_fg->latency_us_SLO = latency_us_SLO;
-	nvme_fg->IOPS_SLO = IOPS_SLO;
-	nvme_fg->rw_ratio_SLO = rw_ratio_SLO;
-	nvme_fg->scaled_IOPS_limit = scaled_IOPS(IOPS_SLO, rw_ratio_SLO);
-	nvme_fg->tid = percpu_get(cpu_nr);
+struct nvme_devmodel_fit {
+	unsigned int lat;							// reference latency of the fit
+	double n, sx, sy, sxx, sxy;					// decayed sums, x = write rate, y = read rate
+};
 
-	if (already_registered_flow == 1 
-		&& nvme_fg->scaled_IOPS_limit != scaled_IOPS(IOPS_SLO, rw_ratio_SLO)){
-		/* 
-		 * A tenant is a logical grouping for an app's connections that want the *same* SLO
-		 * so if a tenant is trying to register different SLOs across connections, give warning
-		 * should register these connections as separate tenants 
-		 *
-		 * Default way to procede here is to overwrite the whole tenant's SLO with the new one 
-		 *
-		 */
-		log_info("warning: tenant connection registered different SLO, will overwrite previous SLO for all of this tenant's connections. 1 SLO per tenant.\n");
-		nvme_fg->scaled_IOPuS_limit = nvme_fg->scaled_IOPS_limit / (double) 1E6; 
-	}
-	
-	if (latency_us_SLO == 0){
-		nvme_fg->latency_critical_flag = false;
-	}
-	else{ 
-		nvme_fg->latency_critical_flag = true;
-	}
+static DEFINE_PERCPU(struct nvme_devmodel_window, nvme_devmodel_local);
+static DEFINE_SPINLOCK(nvme_devmodel_lock);
+static struct nvme_devmodel_window nvme_devmodel_global;
 
-	if (already_registered_flow == 0){
-		nvme_fg->scaled_IOPuS_limit = nvme_fg->scaled_IOPS_limit / (double) 1E6; 
-		ret = recalculate_weights_add(fg_handle); 
-		if (ret < 0) {
-			log_info("warning: cannot satisfy SLO\n"); 
-			return -RET_CANTMEETSLO;
-		}
+// the following are protected by nvme_bitmap_lock, like dev_model itself
+static struct nvme_devmodel_point devmodel_curve[2][DEVMODEL_CURVE_BINS];	// [rdonly][load bin]
+static unsigned long devmodel_bin_width = 1;
+static unsigned long devmodel_epoch = 0;
+static int devmodel_base_write_cost;
+static struct nvme_devmodel_fit devmodel_wr_fit;
 
-		swq = alloc_local_nvme_swq();
-		if (swq == NULL) {
-			log_err("error: can't allocate nvme_swq for flow group\n");
-			return -RET_NOMEM;
-		}	
-		nvme_fg->nvme_swq = swq;
-		nvme_sw_queue_init(swq, fg_handle);
-		thread_tenant_manager = &percpu_get(nvme_tenant_manager);
-		list_add(&thread_tenant_manager->tenant_swq, &swq->list);
-		thread_tenant_manager->num_tenants++;
-		percpu_get(roundrobin_start) = 0; 
-		nvme_fg->conn_ref_count = 0;
-		if (latency_us_SLO == 0){
-			thread_tenant_manager->num_best_effort_tenants++;
-		}
-		
-		if (latency_us_SLO == 0){
-			log_info("Register tenant %ld (port id: %ld). Managed by thread %ld. Best-effort tenant. \n", 
-					 fg_handle, flow_group_id, percpu_get(cpu_nr));
+static void nvme_devmodel_init(void)
+{
+	unsigned long max_rate = 0;
+	int i;
 
-		}
-		else{
-			log_info("Register tenant %ld (port id: %ld). Managed by thread %ld. IOPS_SLO: %lu, r/w %d, scaled_IOPS: %lu tokens/s, latency SLO: %lu us. \n", 
-					 fg_handle, flow_group_id, percpu_get(cpu_nr),  IOPS_SLO, rw_ratio_SLO, nvme_fg->scaled_IOPS_limit, latency_us_SLO);
-		}
-	}
-	nvme_fg->conn_ref_count++;
-	
-	usys_nvme_registered_flow(fg_handle, cookie, RET_OK);
+	if (nvme_dev_model != FLASH_DEV_MODEL || !dev_model_size)
+		nvme_devmodel_online = false;
+	if (!nvme_devmodel_online)
+		return;
 
-	return RET_OK;
+	// leave room on the curve for limits to grow past the profiled ones
+	for (i = 0; i < dev_model_size; i++)
+		max_rate = max(max_rate, (unsigned long) dev_model[i].token_rdonly_rate_limit);
+	devmodel_bin_width = max(2 * max_rate / DEVMODEL_CURVE_BINS, 1UL);
+	devmodel_base_write_cost = NVME_WRITE_COST;
+	nvme_devmodel_global.start = rdtsc();
 }
 
-long bsys_nvme_unregister_flow(long fg_handle) 
+static void nvme_devmodel_account(struct nvme_devmodel_window *w,
+								  struct nvme_ctx *ctx, unsigned long units)
 {
-	struct nvme_tenant_mgmt* thread_tenant_manager;
-	
-	nvme_fgs[fg_handle].conn_ref_count--;
-	if (nvme_fgs[fg_handle].conn_ref_count == 0){
-		thread_tenant_manager = &percpu_get(nvme_tenant_manager);
-		if (!nvme_fgs[fg_handle].latency_critical_flag){
-			thread_tenant_manager->num_best_effort_tenants--;
-		}
-		list_del(&nvme_fgs[fg_handle].nvme_swq->list);
-		free_local_nvme_swq(nvme_fgs[fg_handle].nvme_swq);	
-		thread_tenant_manager->num_tenants--;
-		recalculate_weights_remove(fg_handle);
+	unsigned long lat_us, bucket;
 
-		spin_lock(&nvme_bitmap_lock);	
-		bitmap_clear(nvme_fgs_bitmap, fg_handle);
-		spin_unlock(&nvme_bitmap_lock);
+	if (ctx->cmd != NVME_CMD_READ) {
+		w->wr_units += units;
+		return;
 	}
-	
-	usys_nvme_unregistered_flow(fg_handle, RET_OK);
-	
-	return RET_OK;
+
+	w->rd_units += units;
+	lat_us = (rdtsc() - ctx->time) / cycles_per_us;
+	bucket = lat_us / DEVMODEL_LAT_BUCKET_US;
+	if (bucket >= DEVMODEL_LAT_BUCKETS)
+		bucket = DEVMODEL_LAT_BUCKETS - 1;
+	w->hist[bucket]++;
+	w->samples++;
 }
 
-// request cost scales linearly with size above 4KB
-// note: may need to adjust this if does not match your Flash device behavior
-static int nvme_compute_req_cost(int req_type, size_t req_len) 
+static void nvme_devmodel_record(struct nvme_ctx *ctx)
 {
-	if (req_len <= 0){
-		log_info("ERROR: request size <= 0!\n");
-		return 0;
-	}
-
-	int len_scale_factor = 1;
+	// trims, flushes and write zeroes have their own fixed costs
+	if (ctx->cmd != NVME_CMD_READ && ctx->cmd != NVME_CMD_WRITE)
+		return;
+	nvme_devmodel_account(&percpu_get(nvme_devmodel_local), ctx,
+						  (ctx->lba_count * global_ns_sector_size + 4095) / 4096);
+}
 
-	if (req_len > 4096){
-		// divide req_len by 4096 and round up
-		len_scale_factor = (req_len  + 4096 -1 )/ 4096;
-	}
+static unsigned int nvme_devmodel_p95(struct nvme_devmodel_window *w)
+{
+	unsigned long rank = (w->samples * 95 + 99) / 100;
+	unsigned long count = 0;
+	int i;
 
-	if (req_type == NVME_CMD_READ){
-		return NVME_READ_COST * len_scale_factor;
-	}
-	else if (req_type == NVME_CMD_WRITE) {
-		return NVME_WRITE_COST * len_scale_factor;
+	for (i = 0; i < DEVMODEL_LAT_BUCKETS - 1; i++) {
+		count += w->hist[i];
+		if (count >= rank)
+			break;
 	}
-	return 1;
+	return (i + 1) * DEVMODEL_LAT_BUCKET_US;
+}
+
+/*
+ * nvme_devmodel_fit_write_cost - re-fit the write cost from mixed windows
+ *
+ * Windows that land at about the same p95 latency carry the same weighted
+ * load, so their read and write rates lie on RdIOPS + w * WrIOPS = const.
+ * The slope of read rate vs. write rate over those windows gives w, which is
+ * the same weight_factor sample.devmodel describes profiling by hand.
+ *
+ * NOTE: reservations of LC tenants that are already admitted keep the cost
+ *       they were admitted with, new tenants are charged the re-fit cost.
+ */
+static void nvme_devmodel_fit_write_cost(unsigned int p95, double rd_rate, double wr_rate)
+{
+	struct nvme_devmodel_fit *f = &devmodel_wr_fit;
+	unsigned int ref_lat;
+	double mean_x, mean_y, var, cov;
+	long cost;
+
+	if (lc_slo_heap_size)
+		ref_lat = strictest_lc_latency_SLO();
+	else
+		ref_lat = dev_model[dev_model_size / 2].p95_tail_latency;
+
+	if (f->lat != ref_lat) {
+		memset(f, 0, sizeof(*f));
+		f->lat = ref_lat;
+	}
+	if (p95 < ref_lat * (1 - DEVMODEL_FIT_BAND) || p95 > ref_lat * (1 + DEVMODEL_FIT_BAND))
+		return;
+
+	f->n = f->n * DEVMODEL_FIT_DECAY + 1;
+	f->sx = f->sx * DEVMODEL_FIT_DECAY + wr_rate;
+	f->sy = f->sy * DEVMODEL_FIT_DECAY + rd_rate;
+	f->sxx = f->sxx * DEVMODEL_FIT_DECAY + wr_rate * wr_rate;
+	f->sxy = f->sxy * DEVMODEL_FIT_DECAY + wr_rate * rd_rate;
+	if (f->n < DEVMODEL_FIT_MIN_POINTS)
+		return;
+
+	mean_x = f->sx / f->n;
+	mean_y = f->sy / f->n;
+	var = f->sxx / f->n - mean_x * mean_x;
+	cov = f->sxy / f->n - mean_x * mean_y;
+	// need some spread in the write rate to tell the costs apart
+	if (var < 0.01 * mean_x * mean_x)
+		return;
+
+	cost = (long) (NVME_READ_COST * (-cov / var) + 0.5);
+	cost = max(cost, (long) devmodel_base_write_cost / 2);
+	cost = min(cost, (long) devmodel_base_write_cost * 2);
+	cost = (7 * (long) NVME_WRITE_COST + cost) / 8;
+	if (labs(cost - NVME_WRITE_COST) * 100 < NVME_WRITE_COST)
+		return;
+
+	NVME_WRITE_COST = cost;
+	nvme_build_cost_table();
+	set_token_deficit_limit();
+}
+
+static bool nvme_devmodel_adjust_limit(uint64_t *limit, unsigned int lat_limit,
+									   unsigned long load, double p95)
+{
+	unsigned long target = *limit;
+
+	if (p95 > lat_limit && load < target) {
+		// limit was crossed below the modelled rate
+		target = max(load, target - target / DEVMODEL_STEP_DOWN);
+	}
+	else if (p95 < lat_limit * DEVMODEL_HEADROOM && 
+			 load / devmodel_bin_width == target / devmodel_bin_width) {
+		// running at the modelled rate with latency to spare
+		target = min(target + target / DEVMODEL_STEP_UP, MAX_DEV_TOKEN_RATE);
+	}
+
+	if (target == *limit)
+		return false;
+	*limit = target;
+	return true;
+}
+
+static void nvme_devmodel_update(unsigned int p95, unsigned long rd_units,
+								 unsigned long wr_units, unsigned long elapsed)
+{
+	struct nvme_devmodel_point *pt;
+	double secs = elapsed / (cycles_per_us * 1E6);
+	double rd_rate = rd_units / secs;
+	double wr_rate = wr_units / secs;
+	unsigned long load;
+	bool rdonly = (wr_units == 0);
+	bool changed = false;
+	uint64_t *limit, *prev;
+	int i, bin;
+
+	spin_lock(&nvme_bitmap_lock);
+	devmodel_epoch++;
+
+	load = (unsigned long) (rd_rate * NVME_READ_COST + wr_rate * NVME_WRITE_COST);
+	bin = min(load / devmodel_bin_width, (unsigned long) DEVMODEL_CURVE_BINS - 1);
+	pt = &devmodel_curve[rdonly][bin];
+	if (!pt->epoch || devmodel_epoch - pt->epoch > DEVMODEL_CURVE_TTL)
+		pt->p95 = p95;
+	else
+		pt->p95 += (p95 - pt->p95) / 4;
+	pt->epoch = devmodel_epoch;
+
+	if (!rdonly)
+		nvme_devmodel_fit_write_cost(p95, rd_rate, wr_rate);
+
+	for (i = 0; i < dev_model_size; i++) {
+		limit = rdonly ? &dev_model[i].token_rdonly_rate_limit : &dev_model[i].token_rate_limit;
+		changed |= nvme_devmodel_adjust_limit(limit, dev_model[i].p95_tail_latency, load, pt->p95);
+		// looser latency limits never get a lower token limit
+		if (i > 0) {
+			prev = rdonly ? &dev_model[i-1].token_rdonly_rate_limit : &dev_model[i-1].token_rate_limit;
+			if (*limit < *prev)
+				*limit = *prev;
+		}
+	}
+
+	if (changed && lc_slo_heap_size) {
+		global_token_rate = lookup_device_token_rate(strictest_lc_latency_SLO());
+		if (global_LC_sum_token_rate > global_token_rate)
+			log_warn("device model: LC reservations %lu exceed token rate %lu tokens/s\n",
+					 global_LC_sum_token_rate, global_token_rate);
+		publish_token_rates();
+	}
+	spin_unlock(&nvme_bitmap_lock);
+}
+
+/*
+ * nvme_devmodel_tick - fold this thread's measurements into the shared window
+ * and close the window once it is old enough
+ */
+static void nvme_devmodel_tick(void)
+{
+	struct nvme_devmodel_window *w = &percpu_get(nvme_devmodel_local);
+	struct nvme_devmodel_window *g = &nvme_devmodel_global;
+	unsigned long interval = nvme_devmodel_interval_ms * 1000UL * cycles_per_us;
+	unsigned long now = rdtsc();
+	unsigned long rd_units, wr_units, elapsed;
+	unsigned int p95 = 0;
+	int i;
+
+	if (now - w->start < interval / DEVMODEL_FLUSHES_PER_WINDOW)
+		return;
+
+	spin_lock(&nvme_devmodel_lock);
+	g->rd_units += w->rd_units;
+	g->wr_units += w->wr_units;
+	g->samples += w->samples;
+	for (i = 0; i < DEVMODEL_LAT_BUCKETS; i++)
+		g->hist[i] += w->hist[i];
+
+	elapsed = now - g->start;
+	if (elapsed < interval) {
+		spin_unlock(&nvme_devmodel_lock);
+		goto reset;
+	}
+	if (g->samples >= DEVMODEL_MIN_SAMPLES)
+		p95 = nvme_devmodel_p95(g);
+	rd_units = g->rd_units;
+	wr_units = g->wr_units;
+	memset(g, 0, sizeof(*g));
+	g->start = now;
+	spin_unlock(&nvme_devmodel_lock);
+
+	// an idle device says nothing about its limits
+	if (p95)
+		nvme_devmodel_update(p95, rd_units, wr_units, elapsed);
+
+reset:
+	memset(w, 0, sizeof(*w));
+	w->start = now;
+}
+
+
+/*
+ * nvme_eth_fg_add - count a connection registered in its TCP flow group
+ * @fg_handle: the connection's tenant
+ * @handle: the connection's TCP handle
+ */
+static void nvme_eth_fg_add(long fg_handle, hid_t handle)
+{
+	unsigned int i = NVME_HID_ETH_FG(handle);
+	struct nvme_eth_fg *e = &nvme_eth_fgs[i];
+
+	// outbound flow groups never migrate
+	if (!nvme_rebalance_flag || i >= ETH_MAX_TOTAL_FG)
+		return;
+
+	if (!e->conns++)
+		e->fg_handle = fg_handle;
+	else if (e->fg_handle != fg_handle)
+		e->fg_handle = NVME_ETH_FG_MIXED;
+}
+
+static void nvme_eth_fg_del(hid_t handle)
+{
+	unsigned int i = NVME_HID_ETH_FG(handle);
+	struct nvme_eth_fg *e = &nvme_eth_fgs[i];
+
+	if (!nvme_rebalance_flag || i >= ETH_MAX_TOTAL_FG || !e->conns)
+		return;
+
+	if (!--e->conns)
+		e->fg_handle = 0;
+}
+
+long bsys_nvme_register_flow(long flow_group_id, unsigned long cookie, 
+							 unsigned int latency_us_SLO, unsigned long IOPS_SLO, 
+							 unsigned long rw_ratio_be_weight, hid_t handle)
+{
+	long fg_handle = 0;
+	struct nvme_flow_group* nvme_fg;
+	int ret = 0;
+	int already_registered_flow = 0;
+	struct nvme_sw_queue* swq;
+	struct nvme_fg_bucket *b = nvme_fg_bucket(flow_group_id, percpu_get(cpu_nr));
+	int rw_ratio_SLO = (int) (unsigned int) rw_ratio_be_weight;
+	unsigned int be_weight = rw_ratio_be_weight >> 32;
+
+	spin_lock(&b->lock);
+	already_registered_flow = set_nvme_flow_group_id(flow_group_id, &fg_handle);
+   	if (already_registered_flow < 0){
+		spin_unlock(&b->lock);
+		log_err("error: exceeded max (%d) nvme flow groups!\n", MAX_NVME_FLOW_GROUPS);
+		usys_nvme_registered_flow(-1, cookie, -RET_NOMEM);
+		return -RET_NOMEM;
+	}
+
+	nvme_fg = &nvme_fgs[fg_handle];
+
+	/* 
+	 * A tenant is a logical grouping for an app's connections that want the *same* SLO.
+	 * Compare the SLO as registered: the scaled IOPS derived from it move whenever
+	 * online calibration re-fits the write cost.
+	 */
+	if (already_registered_flow == 1 
+		&& (nvme_fg->latency_us_SLO != latency_us_SLO ||
+		    nvme_fg->IOPS_SLO != IOPS_SLO || nvme_fg->rw_ratio_SLO != rw_ratio_SLO)){
+		/*
+		 * A latency-critical tenant may be resized to another latency-critical
+		 * SLO; switching between latency-critical and best-effort is refused,
+		 * such connections should register as a separate tenant.
+		 */
+		if (!nvme_fg->latency_critical_flag || !latency_us_SLO)
+			ret = -RET_CANTMEETSLO;
+		else
+			ret = recalculate_weights_resize(fg_handle, latency_us_SLO, IOPS_SLO, rw_ratio_SLO);
+		if (ret < 0) {
+			spin_unlock(&b->lock);
+			log_info("warning: tenant %ld can't move to the requested SLO, keeps its current one.\n",
+					 flow_group_id);
+			usys_nvme_registered_flow(-1, cookie, -RET_CANTMEETSLO);
+			return -RET_CANTMEETSLO;
+		}
+		log_info("Resized tenant %ld (port id: %ld). IOPS_SLO: %lu, r/w %d, scaled_IOPS: %lu tokens/s, latency SLO: %u us. \n",
+				 fg_handle, flow_group_id, IOPS_SLO, rw_ratio_SLO, nvme_fg->scaled_IOPS_limit, latency_us_SLO);
+	}
+
+	if (already_registered_flow == 0){
+		nvme_fg->cookie = cookie;
+		nvme_fg->latency_us_SLO = latency_us_SLO;
+		nvme_fg->IOPS_SLO = IOPS_SLO;
+		nvme_fg->rw_ratio_SLO = rw_ratio_SLO;
+		nvme_fg->scaled_IOPS_limit = scaled_IOPS(IOPS_SLO, rw_ratio_SLO);
+		nvme_fg->latency_critical_flag = (latency_us_SLO != 0);
+		nvme_fg->be_weight = be_weight ? be_weight : 1;
+		nvme_fg->next_write_lba = ULONG_MAX;
+		nvme_fg->token_rate_fp = nvme_token_rate_fp(nvme_fg->scaled_IOPS_limit);
+		ret = recalculate_weights_add(fg_handle); 
+		if (ret < 0) {
+			release_nvme_flow_group_id(fg_handle);
+			spin_unlock(&b->lock);
+			log_info("warning: cannot satisfy SLO\n"); 
+			usys_nvme_registered_flow(-1, cookie, -RET_CANTMEETSLO);
+			return -RET_CANTMEETSLO;
+		}
+
+		swq = NULL;
+		if (!nvme_fg->latency_critical_flag ||
+			!nvme_lc_heap_reserve(&percpu_get(nvme_tenant_manager)))
+			swq = alloc_local_nvme_swq();
+		if (swq == NULL) {
+			recalculate_weights_remove(fg_handle);
+			release_nvme_flow_group_id(fg_handle);
+			spin_unlock(&b->lock);
+			log_err("error: can't allocate nvme_swq or LC heap slot for flow group\n");
+			usys_nvme_registered_flow(-1, cookie, -RET_NOMEM);
+			return -RET_NOMEM;
+		}	
+		nvme_fg->nvme_swq = swq;
+		nvme_sw_queue_init(swq, fg_handle);
+		nvme_fg->conn_ref_count = 0;
+		nvme_tenant_attach(&percpu_get(nvme_tenant_manager), nvme_fg);
+		
+		if (latency_us_SLO == 0){
+			log_info("Register tenant %ld (port id: %ld). Managed by thread %ld. Best-effort tenant, weight %u. \n", 
+					 fg_handle, flow_group_id, percpu_get(cpu_nr), nvme_fg->be_weight);
+
+		}
+		else{
+			log_info("Register tenant %ld (port id: %ld). Managed by thread %ld. IOPS_SLO: %lu, r/w %d, scaled_IOPS: %lu tokens/s, latency SLO: %lu us. \n", 
+					 fg_handle, flow_group_id, percpu_get(cpu_nr),  IOPS_SLO, rw_ratio_SLO, nvme_fg->scaled_IOPS_limit, latency_us_SLO);
+		}
+	}
+	nvme_fg->conn_ref_count++;
+	spin_unlock(&b->lock);
+	nvme_eth_fg_add(fg_handle, handle);
+	
+	usys_nvme_registered_flow(fg_handle, cookie, RET_OK);
+
+	return RET_OK;
+}
+
+long bsys_nvme_unregister_flow(long fg_handle, hid_t handle) 
+{
+	struct nvme_fg_bucket *b;
+	bool last_conn;
+
+	nvme_eth_fg_del(handle);
+
+	b = nvme_fg_lock(&nvme_fgs[fg_handle]);
+	last_conn = (--nvme_fgs[fg_handle].conn_ref_count == 0);
+	// a new registration of this flow group id starts a new tenant
+	if (last_conn)
+		hlist_del(&nvme_fgs[fg_handle].link);
+	spin_unlock(&b->lock);
+
+	if (last_conn)
+		nvme_tenant_release((void *) fg_handle);
+	
+	usys_nvme_unregistered_flow(fg_handle, RET_OK);
+	
+	return RET_OK;
+}
+
+/*
+ * Request costs are precomputed per opcode for every size up to
+ * NVME_COST_TBL_MAX in NVME_COST_TBL_GRAN steps. Without a cost curve in the
+ * devmodel, cost scales linearly with 4KB units; with one, cost is
+ * interpolated between the given sizes and scaled linearly past the last one.
+ */
+#define NVME_COST_TBL_GRAN		512
+#define NVME_COST_TBL_MAX		(128 * 1024)
+#define NVME_COST_TBL_ENTRIES	(NVME_COST_TBL_MAX / NVME_COST_TBL_GRAN + 1)
+
+/*
+ * The online calibration rebuilds the table on one core while the others
+ * look costs up, so there are two copies: a rebuild fills the spare one and
+ * then publishes it by flipping nvme_cost_tbl_cur. Rebuilds are at least a
+ * calibration window apart, long after any lookup of the old copy is done.
+ */
+static int nvme_cost_tbls[2][2][NVME_COST_TBL_ENTRIES];	// [copy][NVME_CMD_*][size / NVME_COST_TBL_GRAN]
+static unsigned int nvme_cost_tbl_cur;
+
+static unsigned long nvme_cost_curve_at(struct nvme_cost_curve *curve, unsigned long len)
+{
+	struct nvme_cost_point *p0, *p1;
+	int i;
+
+	if (len <= curve->points[0].size)
+		return curve->points[0].cost;
+
+	for (i = 1; i < curve->num_points; i++) {
+		if (len <= curve->points[i].size) {
+			p0 = &curve->points[i-1];
+			p1 = &curve->points[i];
+			return p0->cost + ((unsigned long) (p1->cost - p0->cost) * (len - p0->size)) 
+							  / (p1->size - p0->size);
+		}
+	}
+
+	p1 = &curve->points[curve->num_points - 1];
+	return (unsigned long) p1->cost * len / p1->size;
+}
+
+/*
+ * nvme_build_cost_table - (re)compute the request cost table
+ *
+ * NVME_READ_COST and NVME_WRITE_COST are the cost of a 4KB request. A cost
+ * curve gives the shape over sizes and is rescaled to match them, so the
+ * online calibration can keep refitting the 4KB write cost.
+ */
+static void nvme_build_cost_table(void)
+{
+	struct nvme_cost_curve *curve;
+	unsigned long len, base;
+	unsigned int next = !nvme_cost_tbl_cur;
+	int (*tbl)[NVME_COST_TBL_ENTRIES] = nvme_cost_tbls[next];
+	int cmd, cost_4KB, i;
+
+	for (cmd = NVME_CMD_READ; cmd <= NVME_CMD_WRITE; cmd++) {
+		curve = cmd == NVME_CMD_READ ? &nvme_read_cost_curve : &nvme_write_cost_curve;
+		cost_4KB = cmd == NVME_CMD_READ ? NVME_READ_COST : NVME_WRITE_COST;
+		base = curve->num_points ? nvme_cost_curve_at(curve, 4096) : 0;
+
+		for (i = 1; i < NVME_COST_TBL_ENTRIES; i++) {
+			len = i * NVME_COST_TBL_GRAN;
+			if (base)
+				tbl[cmd][i] = (nvme_cost_curve_at(curve, len) * cost_4KB + base / 2) / base;
+			else
+				tbl[cmd][i] = cost_4KB * ((len + 4096 - 1) / 4096);
+		}
+	}
+
+	// the new copy must be complete before anyone can pick it
+	__sync_synchronize();
+	*(volatile unsigned int *) &nvme_cost_tbl_cur = next;
+}
+
+static void nvme_init_cost_table(void)
+{
+	// a cost curve sets the 4KB costs too
+	if (nvme_read_cost_curve.num_points)
+		NVME_READ_COST = nvme_cost_curve_at(&nvme_read_cost_curve, 4096);
+	if (nvme_write_cost_curve.num_points)
+		NVME_WRITE_COST = nvme_cost_curve_at(&nvme_write_cost_curve, 4096);
+	nvme_build_cost_table();
+	if (nvme_seq_write_discount)
+		log_info("DEVICE PARAMS: sequential writes cost %d%% less\n", nvme_seq_write_discount);
+}
+
+static int nvme_compute_req_cost(int req_type, size_t req_len) 
+{
+	int (*tbl)[NVME_COST_TBL_ENTRIES];
+	size_t idx;
+
+	switch (req_type) {
+	case NVME_CMD_TRIM:
+		return NVME_TRIM_COST;
+	case NVME_CMD_FLUSH:
+		return NVME_FLUSH_COST;
+	case NVME_CMD_WRITE_ZEROES:
+		return NVME_WRITE_ZEROES_COST * ((req_len + 4096 - 1) / 4096);
+	}
+
+	if (req_len <= 0){
+		log_info("ERROR: request size <= 0!\n");
+		return 0;
+	}
+	if (req_type != NVME_CMD_READ && req_type != NVME_CMD_WRITE)
+		return 1;
+
+	tbl = nvme_cost_tbls[*(volatile unsigned int *) &nvme_cost_tbl_cur];
+	idx = (req_len + NVME_COST_TBL_GRAN - 1) / NVME_COST_TBL_GRAN;
+	if (likely(idx < NVME_COST_TBL_ENTRIES))
+		return tbl[req_type][idx];
+
+	// past the table, scale the largest entry linearly
+	return (long) tbl[req_type][NVME_COST_TBL_ENTRIES - 1] * idx / (NVME_COST_TBL_ENTRIES - 1);
+}
+
+/*
+ * nvme_write_req_cost - cost of a tenant's write, discounted if it continues
+ * where the tenant's previous write ended
+ */
+static int nvme_write_req_cost(struct nvme_flow_group *fg, unsigned long lba,
+							   unsigned int lba_count)
+{
+	int cost = nvme_compute_req_cost(NVME_CMD_WRITE, lba_count * global_ns_sector_size);
+
+	if (nvme_seq_write_discount && lba == fg->next_write_lba)
+		cost -= cost * nvme_seq_write_discount / 100;
+	fg->next_write_lba = lba + lba_count;
+	return cost;
 }
 
 long bsys_nvme_write(hqu_t fg_handle, void __user *__restrict vaddr, unsigned long lba,
@@ -955,6 +1808,8 @@ long bsys_nvme_write(hqu_t fg_handle, void __user *__restrict vaddr, unsigned lo
 		return -RET_NOMEM;
 	}
 	ctx->cookie = cookie;
+	ctx->tid = percpu_get(cpu_nr);
+	ctx->cmd = NVME_CMD_WRITE;
 
 	paddr = (void *) vm_lookup_phys(vaddr, PGSIZE_2MB);
 	if (unlikely(!paddr)) {
@@ -966,29 +1821,28 @@ long bsys_nvme_write(hqu_t fg_handle, void __user *__restrict vaddr, unsigned lo
 	
 	if (nvme_sched_flag){
 		// Store all info in ctx before add to software queue
-		ctx->tid = percpu_get(cpu_nr);
 		ctx->fg_handle = fg_handle; 
-		ctx->cmd = NVME_CMD_WRITE;
-		ctx->req_cost = nvme_compute_req_cost(NVME_CMD_WRITE, lba_count * global_ns_sector_size);
+		ctx->req_cost = nvme_write_req_cost(&nvme_fgs[fg_handle], lba, lba_count);
 		ctx->ns = ns;
 		ctx->paddr = paddr;
 		ctx->lba = lba;
 		ctx->lba_count = lba_count;
 
 		// add to SW queue
-		//struct nvme_sw_queue swq = percpu_get(nvme_swq[ctx->priority]);
 		struct nvme_sw_queue* swq = nvme_fgs[fg_handle].nvme_swq;
-		ret = nvme_sw_queue_push_back(swq, ctx);
+		ret = nvme_sched_enqueue(swq, ctx);
 		if (ret != 0) {
 			free_local_nvme_ctx(ctx);
 			return -RET_NOMEM;
 		}
 	}
 	else {
+		ctx->time = rdtsc();
 		ret = spdk_nvme_ns_cmd_write(ns, percpu_get(qpair), paddr, lba, lba_count, nvme_write_cb, ctx, 0);
 		if(ret != 0)
 			log_info("NVME Write ret: %lx\n", ret);
 		assert(ret == 0);
+		nvme_inflight_inc();
 	}
 
 	return RET_OK;
@@ -1010,6 +1864,8 @@ long bsys_nvme_read(hqu_t fg_handle, void __user *__restrict vaddr, unsigned lon
 		return -RET_NOMEM;
 	}
 	ctx->cookie = cookie;
+	ctx->tid = percpu_get(cpu_nr);
+	ctx->cmd = NVME_CMD_READ;
 	
 	paddr = (void *) vm_lookup_phys(vaddr, PGSIZE_2MB);
 	if (unlikely(!paddr)) {
@@ -1022,9 +1878,7 @@ long bsys_nvme_read(hqu_t fg_handle, void __user *__restrict vaddr, unsigned lon
 	
 	if (nvme_sched_flag) {
 		// Store all info in ctx before add to software queue
-		ctx->tid = percpu_get(cpu_nr);
 		ctx->fg_handle = fg_handle; 
-		ctx->cmd = NVME_CMD_READ;
 		ctx->req_cost = nvme_compute_req_cost(NVME_CMD_READ, lba_count * global_ns_sector_size);
 		ctx->ns = ns;
 		ctx->paddr = paddr;
@@ -1033,7 +1887,7 @@ long bsys_nvme_read(hqu_t fg_handle, void __user *__restrict vaddr, unsigned lon
 
 		// add to SW queue
 		struct nvme_sw_queue* swq = nvme_fgs[fg_handle].nvme_swq;
-		ret = nvme_sw_queue_push_back(swq, ctx);
+		ret = nvme_sched_enqueue(swq, ctx);
 		if (ret != 0) {
 			free_local_nvme_ctx(ctx);
 			return -RET_NOMEM;
@@ -1041,15 +1895,129 @@ long bsys_nvme_read(hqu_t fg_handle, void __user *__restrict vaddr, unsigned lon
 	}
 	else {
 		assert(((lba / lba_count) * lba_count) == lba);
+		ctx->time = rdtsc();
 		ret = spdk_nvme_ns_cmd_read(ns, percpu_get(qpair), paddr, lba, lba_count, nvme_read_cb, ctx, 0);
 		if(ret != 0)
 			log_info("NVME Read ret: %lx\n", ret);
 		assert(ret == 0);
+		nvme_inflight_inc();
 	}
 
 	return RET_OK;
 }
 
+/*
+ * Buffer pools that back NVMe I/O (the server's request buffers, the mbufs
+ * used as zero-copy write payload) are registered once and translated up
+ * front: each 2MB page of a region keeps its device address, so building an
+ * SGL is a range check and an add instead of a page walk per 4KB element.
+ * Regions are only ever appended; readers scan without the lock and see a
+ * region once nvme_iova_nr covers it.
+ */
+#define NVME_IOVA_MAX_REGIONS	8
+
+struct nvme_iova_region {
+	uintptr_t	base;		/* user address, 2MB aligned */
+	uintptr_t	end;
+	uint64_t	*iova;		/* device address of each 2MB page */
+};
+
+static struct nvme_iova_region nvme_iova_regions[NVME_IOVA_MAX_REGIONS];
+static unsigned int nvme_iova_nr;
+static DEFINE_SPINLOCK(nvme_iova_lock);
+
+/**
+ * nvme_register_buf_region - pre-translates a buffer pool for NVMe I/O
+ * @vaddr: the user address of the pool (2MB aligned)
+ * @len: the length of the pool in bytes
+ *
+ * Registering the same region again is a no-op.
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int nvme_register_buf_region(void __user *vaddr, size_t len)
+{
+	struct nvme_iova_region *r;
+	uintptr_t base = (uintptr_t) vaddr;
+	unsigned int i, nr_pages;
+	physaddr_t paddr;
+	uint64_t *iova;
+
+	if (!len || PGOFF_2MB(base))
+		return -RET_INVAL;
+
+	nr_pages = PGN_2MB(len + PGMASK_2MB);
+	iova = malloc(nr_pages * sizeof(uint64_t));
+	if (!iova)
+		return -RET_NOMEM;
+
+	for (i = 0; i < nr_pages; i++) {
+		paddr = vm_lookup_phys((void *) (base + i * PGSIZE_2MB), PGSIZE_2MB);
+		if (unlikely(!paddr)) {
+			free(iova);
+			return -RET_FAULT;
+		}
+		iova[i] = nvme_vtophys((void *) paddr);
+	}
+
+	spin_lock(&nvme_iova_lock);
+	for (i = 0; i < nvme_iova_nr; i++) {
+		if (nvme_iova_regions[i].base == base) {
+			spin_unlock(&nvme_iova_lock);
+			free(iova);
+			return 0;
+		}
+	}
+	if (nvme_iova_nr == NVME_IOVA_MAX_REGIONS) {
+		spin_unlock(&nvme_iova_lock);
+		free(iova);
+		log_err("nvme: no room to register buffer region %p\n", vaddr);
+		return -RET_NOBUFS;
+	}
+	r = &nvme_iova_regions[nvme_iova_nr];
+	r->base = base;
+	r->end = base + nr_pages * PGSIZE_2MB;
+	r->iova = iova;
+	*(volatile unsigned int *) &nvme_iova_nr = nvme_iova_nr + 1;
+	spin_unlock(&nvme_iova_lock);
+
+	log_info("nvme: registered buffer region %p (%u 2MB pages)\n",
+		 vaddr, nr_pages);
+	return 0;
+}
+
+long bsys_nvme_register_buf(void __user *vaddr, unsigned long len)
+{
+	return nvme_register_buf_region(vaddr, len);
+}
+
+/**
+ * nvme_buf_iova - gets the device address of a user buffer
+ * @vaddr: the user address
+ *
+ * Falls back to a page walk for buffers outside every registered region.
+ *
+ * Returns the device address, or 0 if @vaddr is not mapped.
+ */
+static inline uint64_t nvme_buf_iova(void __user *vaddr)
+{
+	uintptr_t addr = (uintptr_t) vaddr;
+	unsigned int i, nr = *(volatile unsigned int *) &nvme_iova_nr;
+	struct nvme_iova_region *r;
+	physaddr_t paddr;
+
+	for (i = 0; i < nr; i++) {
+		r = &nvme_iova_regions[i];
+		if (addr >= r->base && addr < r->end)
+			return r->iova[PGN_2MB(addr - r->base)] + PGOFF_2MB(addr);
+	}
+
+	paddr = vm_lookup_phys(vaddr, PGSIZE_2MB);
+	if (unlikely(!paddr))
+		return 0;
+	return nvme_vtophys((void *) ((uintptr_t) paddr + PGOFF_2MB(addr)));
+}
+
 static void sgl_reset_cb(void *cb_arg, uint32_t sgl_offset)
 {
 	struct nvme_ctx *ctx = (struct nvme_ctx *)cb_arg;
@@ -1059,7 +2027,6 @@ static void sgl_reset_cb(void *cb_arg, uint32_t sgl_offset)
 
 static int sgl_next_cb(void *cb_arg, uint64_t *address, uint32_t *length)
 {
-	void *paddr;
 	void __user *__restrict temp;
 	struct nvme_ctx *ctx = (struct nvme_ctx *)cb_arg;
 	
@@ -1071,15 +2038,11 @@ static int sgl_next_cb(void *cb_arg, uint64_t *address, uint32_t *length)
 	}
 	else {
 		temp = ctx->user_buf.sgl_buf.sgl[ctx->user_buf.sgl_buf.current_sgl++];
-		paddr = (void *) vm_lookup_phys(temp, PGSIZE_2MB);
-		if (unlikely(!paddr)) {
+		*address = nvme_buf_iova(temp);
+		if (unlikely(!*address)) {
 			log_info("no paddr for requested buf!\n");
 			return -RET_FAULT;
 		}
-		//virt to phys
-		*address = (uint64_t) ((uintptr_t) paddr + PGOFF_2MB(temp));
-		//phys to hw
-		*address = nvme_vtophys((void *)*address);
 		*length = PGSIZE_4KB;
 	}
 	return 0;
@@ -1100,33 +2063,35 @@ long bsys_nvme_writev(hqu_t fg_handle, void __user **__restrict buf, int num_sgl
 		return -RET_NOMEM;
 	}
 	ctx->cookie = cookie;
+	ctx->tid = percpu_get(cpu_nr);
+	ctx->cmd = NVME_CMD_WRITE;
 	ctx->user_buf.sgl_buf.sgl = buf;
 	ctx->user_buf.sgl_buf.num_sgls = num_sgls;
 
 	if (nvme_sched_flag) {
 		// Store all info in ctx before add to software queue
-		ctx->tid = percpu_get(cpu_nr);
 		ctx->fg_handle = fg_handle; 
-		ctx->cmd = NVME_CMD_WRITE;
-		ctx->req_cost = nvme_compute_req_cost(NVME_CMD_WRITE, lba_count * global_ns_sector_size);
+		ctx->req_cost = nvme_write_req_cost(&nvme_fgs[fg_handle], lba, lba_count);
 		ctx->ns = ns;
 		ctx->lba = lba;
 		ctx->lba_count = lba_count;
 
 		// add to SW queue
 		struct nvme_sw_queue* swq = nvme_fgs[fg_handle].nvme_swq;
-		ret = nvme_sw_queue_push_back(swq, ctx);
+		ret = nvme_sched_enqueue(swq, ctx);
 		if (ret != 0) {
 			free_local_nvme_ctx(ctx);
 			return -RET_NOMEM;
 		}
 	}
 	else {
+		ctx->time = rdtsc();
 		ret = spdk_nvme_ns_cmd_writev(ns, percpu_get(qpair), lba, lba_count,
 									  nvme_write_cb, ctx, 0, sgl_reset_cb, sgl_next_cb);
 		if(ret != 0)
 			log_info("Writev failed: %lx %lx %lx\n", ret, num_sgls, lba_count);
 		assert(ret == 0);
+		nvme_inflight_inc();
 	}
 
 	return RET_OK;
@@ -1147,14 +2112,14 @@ long bsys_nvme_readv(hqu_t fg_handle, void __user **__restrict buf, int num_sgls
 		return -RET_NOMEM;
 	}
 	ctx->cookie = cookie;
+	ctx->tid = percpu_get(cpu_nr);
+	ctx->cmd = NVME_CMD_READ;
 	ctx->user_buf.sgl_buf.sgl = buf;
 	ctx->user_buf.sgl_buf.num_sgls = num_sgls;
 	
 	if (nvme_sched_flag) {
 		// Store all info in ctx before add to software queue
-		ctx->tid = percpu_get(cpu_nr);
 		ctx->fg_handle = fg_handle; 
-		ctx->cmd = NVME_CMD_READ;
 		ctx->req_cost = nvme_compute_req_cost(NVME_CMD_READ, lba_count * global_ns_sector_size);
 		ctx->ns = ns;
 		ctx->lba = lba;
@@ -1162,7 +2127,7 @@ long bsys_nvme_readv(hqu_t fg_handle, void __user **__restrict buf, int num_sgls
 
 		// add to SW queue
 		struct nvme_sw_queue* swq = nvme_fgs[fg_handle].nvme_swq;
-		ret = nvme_sw_queue_push_back(swq, ctx);
+		ret = nvme_sched_enqueue(swq, ctx);
 		if (ret != 0) {
 			free_local_nvme_ctx(ctx);
 			log_info("returning NOMEM from readv\n");
@@ -1170,63 +2135,777 @@ long bsys_nvme_readv(hqu_t fg_handle, void __user **__restrict buf, int num_sgls
 		}
 	}
 	else {
+		ctx->time = rdtsc();
 		ret = spdk_nvme_ns_cmd_readv(ns, percpu_get(qpair), lba, lba_count,
 									 nvme_read_cb, ctx, 0, sgl_reset_cb, sgl_next_cb);
 		if(ret != 0)
 			log_info("Readv failed: %lx %lx %lx\n", ret, num_sgls, lba_count);
 		assert(ret == 0);
+		nvme_inflight_inc();
 	}
 	
 	return RET_OK;
 }
 
-unsigned long try_acquire_global_tokens(unsigned long token_demand) {
-	unsigned long new_token_level = 0;
-	unsigned long avail_tokens = 0;
+/*
+ * nvme_submit_nodata - submit a trim, flush or write zeroes command
+ *
+ * These move no data between host and device. They complete like writes.
+ */
+static int nvme_submit_nodata(struct nvme_ctx *ctx)
+{
+	struct spdk_nvme_dsm_range *range;
+
+	BUILD_ASSERT(sizeof(ctx->user_buf.dsm_range) == sizeof(struct spdk_nvme_dsm_range));
+
+	switch (ctx->cmd) {
+	case NVME_CMD_TRIM:
+		// the range lives in ctx, so it stays valid until the command completes
+		range = (struct spdk_nvme_dsm_range *) ctx->user_buf.dsm_range;
+		range->attributes = SPDK_NVME_DSM_ATTR_DEALLOCATE;
+		range->length = ctx->lba_count;
+		range->starting_lba = ctx->lba;
+		return spdk_nvme_ns_cmd_deallocate(ctx->ns, percpu_get(qpair), range, 1,
+										   nvme_write_cb, ctx);
+	case NVME_CMD_FLUSH:
+		return spdk_nvme_ns_cmd_flush(ctx->ns, percpu_get(qpair), nvme_write_cb, ctx);
+	case NVME_CMD_WRITE_ZEROES:
+		return spdk_nvme_ns_cmd_write_zeroes(ctx->ns, percpu_get(qpair), ctx->lba,
+											 ctx->lba_count, nvme_write_cb, ctx, 0);
+	}
+	panic("unrecognized nvme request\n");
+}
 
-	while (1) {
-		avail_tokens = atomic_u64_read(&global_leftover_tokens);
+static long nvme_nodata_cmd(hqu_t fg_handle, int cmd, unsigned long lba,
+							unsigned int lba_count, unsigned long cookie)
+{
+	struct nvme_ctx *ctx;
+	int ret;
 
-		if (token_demand > avail_tokens) {
-			if (atomic_u64_cmpxchg(&global_leftover_tokens, avail_tokens, 0)){
-				return avail_tokens;
-			}
+	ctx = alloc_local_nvme_ctx();
+	if (ctx == NULL) {
+		log_info("ERROR: Cannot allocate memory for nvme_ctx in bsys_nvme_%s\n",
+				 cmd == NVME_CMD_TRIM ? "trim" :
+				 cmd == NVME_CMD_FLUSH ? "flush" : "write_zeroes");
+		return -RET_NOMEM;
+	}
+	ctx->cookie = cookie;
+	ctx->tid = percpu_get(cpu_nr);
+	ctx->cmd = cmd;
+	ctx->ns = spdk_nvme_ctrlr_get_ns(nvme_ctrlr, global_ns_id);
+	ctx->lba = lba;
+	ctx->lba_count = lba_count;
 
+	if (nvme_sched_flag) {
+		// no data to wait on, so these queue behind the tenant's writes
+		ctx->fg_handle = fg_handle;
+		ctx->req_cost = nvme_compute_req_cost(cmd, lba_count * global_ns_sector_size);
+
+		struct nvme_sw_queue* swq = nvme_fgs[fg_handle].nvme_swq;
+		ret = nvme_sched_enqueue(swq, ctx);
+		if (ret != 0) {
+			free_local_nvme_ctx(ctx);
+			return -RET_NOMEM;
 		}
-		else {
-			new_token_level = avail_tokens - token_demand;
-			if (atomic_u64_cmpxchg(&global_leftover_tokens, avail_tokens, new_token_level)){
-				return token_demand;
-			}
-		}
 	}
+	else {
+		ctx->time = rdtsc();
+		ret = nvme_submit_nodata(ctx);
+		if (ret != 0)
+			log_info("NVME cmd %d failed: %d %lx %x\n", cmd, ret, lba, lba_count);
+		assert(ret == 0);
+		nvme_inflight_inc();
+	}
+
+	return RET_OK;
 }
 
-static void issue_nvme_req(struct nvme_ctx* ctx)
+long bsys_nvme_trim(hqu_t fg_handle, unsigned long lba, unsigned int lba_count,
+		    unsigned long cookie)
 {
-	int ret;
+	if (unlikely(!lba_count))
+		return -RET_INVAL;
 
-	//don't schedule request on flash if FAKE_FLASH test	
-	if (nvme_dev_model == FAKE_FLASH) {
-		if (ctx->cmd == NVME_CMD_READ) {
-			usys_nvme_response(ctx->cookie, ctx->user_buf.buf, RET_OK);
-			percpu_get(received_nvme_completions)++;
-		}
-		else if (ctx->cmd == NVME_CMD_WRITE) {
-			usys_nvme_written(ctx->cookie, RET_OK);
-			percpu_get(received_nvme_completions)++;
-		}
-		free_local_nvme_ctx(ctx);
+	return nvme_nodata_cmd(fg_handle, NVME_CMD_TRIM, lba, lba_count, cookie);
+}
 
-		return; 
-	}
+long bsys_nvme_write_zeroes(hqu_t fg_handle, unsigned long lba, unsigned int lba_count,
+			    unsigned long cookie)
+{
+	// the command's block count is a 16-bit, zero-based field
+	if (unlikely(!lba_count || lba_count > 65536))
+		return -RET_INVAL;
 
-	if (ctx->cmd == NVME_CMD_READ) {
-		// if PRP:
-		//ret = spdk_nvme_ns_cmd_read(ctx->ns, percpu_get(qpair), ctx->paddr, ctx->lba, ctx->lba_count, nvme_read_cb, ctx, 0);
-		// for SGL:
-		ret = spdk_nvme_ns_cmd_readv(ctx->ns, percpu_get(qpair), ctx->lba, ctx->lba_count,
-									 nvme_read_cb, ctx, 0, sgl_reset_cb, sgl_next_cb);
+	return nvme_nodata_cmd(fg_handle, NVME_CMD_WRITE_ZEROES, lba, lba_count, cookie);
+}
+
+long bsys_nvme_flush(hqu_t fg_handle, unsigned long cookie)
+{
+	return nvme_nodata_cmd(fg_handle, NVME_CMD_FLUSH, 0, 0, cookie);
+}
+
+static void nvme_handoff_push(struct list_head *list, struct nvme_ctx *ctx,
+							  unsigned int cpu)
+{
+	struct nvme_handoff *h = &nvme_handoff[cpu];
+
+	spin_lock(&h->lock);
+	list_add_tail(list, &ctx->link);
+	spin_unlock(&h->lock);
+}
+
+/*
+ * nvme_sched_queue - queue a request in its tenant's software queue
+ *
+ * With tenant_rebalance, requests of a tenant that moved to another thread
+ * are handed to that thread, which queues them on its next scheduling round.
+ * Otherwise a tenant never leaves the thread its connections register on.
+ * Best-effort tenants
+ * join the thread's active ring when they become backlogged, so subround2
+ * only visits tenants that have work; a tenant still on its way to this
+ * thread joins the ring once it is adopted.
+ */
+static int nvme_sched_queue(struct nvme_sw_queue *swq, struct nvme_ctx *ctx)
+{
+	struct nvme_tenant_mgmt *thread_tenant_manager;
+	struct nvme_flow_group *fg = &nvme_fgs[swq->fg_handle];
+	unsigned int tid;
+	int ret;
+
+	if (nvme_rebalance_flag) {
+		tid = *(volatile unsigned int *) &fg->tid;
+		if (tid != percpu_get(cpu_nr)) {
+			nvme_handoff_push(&nvme_handoff[tid].reqs, ctx, tid);
+			return 0;
+		}
+	}
+
+	ret = nvme_sw_queue_push_back(swq, ctx);
+	if (ret)
+		return ret;
+
+	if (!swq->active && !fg->latency_critical_flag && !fg->migrating) {
+		thread_tenant_manager = &percpu_get(nvme_tenant_manager);
+		list_add_tail(&thread_tenant_manager->be_active, &swq->active_link);
+		swq->active = true;
+	}
+	return 0;
+}
+
+/*
+ * nvme_sched_enqueue - queue a newly submitted request
+ *
+ * The request is due one latency SLO after its arrival; subround1 serves
+ * latency-critical tenants in order of their earliest due request.
+ */
+static int nvme_sched_enqueue(struct nvme_sw_queue *swq, struct nvme_ctx *ctx)
+{
+	ctx->deadline = rdtsc() +
+		(unsigned long) nvme_fgs[swq->fg_handle].latency_us_SLO * cycles_per_us;
+
+	return nvme_sched_queue(swq, ctx);
+}
+
+/*
+ * nvme_complete_req - deliver a completion where the connection lives
+ * @ctx: the completed request
+ * @ret: the status to report to the application
+ *
+ * That is the submitting thread, or with tenant_rebalance the thread the
+ * tenant, and with it the connection, has moved to since.
+ */
+static void nvme_complete_req(struct nvme_ctx *ctx, long ret)
+{
+	unsigned int tid = ctx->tid;
+
+	if (nvme_rebalance_flag)
+		tid = *(volatile unsigned int *) &nvme_fgs[ctx->fg_handle].tid;
+
+	if (tid != percpu_get(cpu_nr)) {
+		ctx->status = ret;
+		nvme_handoff_push(&nvme_handoff[tid].done, ctx, tid);
+		return;
+	}
+
+	if (ctx->cmd == NVME_CMD_READ)
+		usys_nvme_completion(USYS_NVME_RESPONSE, ctx->cookie, ctx->user_buf.buf, ret);
+	else
+		usys_nvme_completion(USYS_NVME_WRITTEN, ctx->cookie, NULL, ret);
+	free_local_nvme_ctx(ctx);
+}
+
+/*
+ * nvme_handoff_drain_reqs - queue the requests other threads handed over
+ */
+static void nvme_handoff_drain_reqs(void)
+{
+	struct nvme_handoff *h = &nvme_handoff[percpu_get(cpu_nr)];
+	struct nvme_ctx *ctx, *next;
+	LIST_HEAD(reqs);
+
+	if (list_empty(&h->reqs))
+		return;
+
+	spin_lock(&h->lock);
+	list_append_list(&reqs, &h->reqs);
+	spin_unlock(&h->lock);
+
+	// the tenant may have moved on again, nvme_sched_queue forwards those
+	list_for_each_safe(&reqs, ctx, next, link) {
+		if (nvme_sched_queue(nvme_fgs[ctx->fg_handle].nvme_swq, ctx))
+			nvme_complete_req(ctx, -RET_NOMEM);
+	}
+}
+
+/*
+ * nvme_handoff_drain_done - deliver the completions other threads handed back
+ */
+static void nvme_handoff_drain_done(void)
+{
+	struct nvme_handoff *h = &nvme_handoff[percpu_get(cpu_nr)];
+	struct nvme_ctx *ctx, *next;
+	LIST_HEAD(done);
+
+	if (list_empty(&h->done))
+		return;
+
+	spin_lock(&h->lock);
+	list_append_list(&done, &h->done);
+	spin_unlock(&h->lock);
+
+	list_for_each_safe(&done, ctx, next, link) {
+		nvme_complete_req(ctx, ctx->status);
+		percpu_get(received_nvme_completions)++;
+	}
+}
+
+/*
+ * Tenant migration
+ *
+ * Moves a tenant (its software queue with the queued requests, token credit
+ * and saved tokens) from the current thread to another, together with the
+ * TCP flow groups (eth_fg) of its connections, so the connections keep being
+ * served by the thread scheduling their tenant. Requests issued before the
+ * move complete on the old thread and their events are handed over. Only
+ * tenants whose connections are the only ones in their flow groups can move,
+ * and the application must cope with connections moving between threads, as
+ * with the control plane's CP_CMD_MIGRATE.
+ */
+/*
+ * nvme_lc_heap_reserve - make room for one more LC tenant in the thread's
+ * dispatch heap
+ *
+ * The heap only grows, so it doesn't cost an allocation every time a tenant
+ * comes and goes. Returns 0 if successful, otherwise -ENOMEM.
+ */
+static int nvme_lc_heap_reserve(struct nvme_tenant_mgmt *mgr)
+{
+	int num_lc = mgr->num_tenants - mgr->num_best_effort_tenants;
+	struct nvme_sw_queue **heap;
+	int cap;
+
+	if (num_lc < mgr->lc_edf_cap)
+		return 0;
+
+	cap = mgr->lc_edf_cap ? 2 * mgr->lc_edf_cap : NVME_LC_HEAP_MIN;
+	heap = realloc(mgr->lc_edf_heap, cap * sizeof(*heap));
+	if (!heap)
+		return -ENOMEM;
+
+	mgr->lc_edf_heap = heap;
+	mgr->lc_edf_cap = cap;
+	return 0;
+}
+
+static void nvme_tenant_attach(struct nvme_tenant_mgmt *mgr, struct nvme_flow_group *fg)
+{
+	struct nvme_sw_queue *swq = fg->nvme_swq;
+
+	if (fg->latency_critical_flag) {
+		// a registration reserves its slot, only a migrated tenant can miss one
+		if (nvme_lc_heap_reserve(mgr))
+			log_err("nvme: LC tenant %ld only dispatched when fewer tenants are eligible\n",
+					swq->fg_handle);
+		mgr->num_tenants++;
+		list_add_tail(&mgr->lc_swq, &swq->list);
+		return;
+	}
+
+	mgr->num_tenants++;
+
+	list_add_tail(&mgr->be_swq, &swq->list);
+	mgr->num_best_effort_tenants++;
+	mgr->be_weight_sum += fg->be_weight;
+	if (!nvme_sw_queue_isempty(swq)) {
+		list_add_tail(&mgr->be_active, &swq->active_link);
+		swq->active = true;
+	}
+}
+
+static void nvme_tenant_detach(struct nvme_tenant_mgmt *mgr, struct nvme_flow_group *fg)
+{
+	struct nvme_sw_queue *swq = fg->nvme_swq;
+
+	mgr->num_tenants--;
+	list_del(&swq->list);
+	if (swq->active) {
+		list_del(&swq->active_link);
+		swq->active = false;
+	}
+	if (!fg->latency_critical_flag) {
+		mgr->num_best_effort_tenants--;
+		mgr->be_weight_sum -= fg->be_weight;
+	}
+}
+
+static void nvme_tenant_adopt(void *data)
+{
+	struct nvme_flow_group *fg = &nvme_fgs[(long) data];
+
+	fg->migrating = false;
+	nvme_tenant_attach(&percpu_get(nvme_tenant_manager), fg);
+}
+
+/*
+ * nvme_tenant_release - free a tenant after its last connection is gone
+ * @data: the flow group handle
+ *
+ * Must run on the thread scheduling the tenant, so it follows the tenant
+ * if it is being migrated.
+ */
+static void nvme_tenant_release(void *data)
+{
+	long fg_handle = (long) data;
+	struct nvme_flow_group *fg = &nvme_fgs[fg_handle];
+
+	if (fg->tid != percpu_get(cpu_nr) || fg->migrating) {
+		if (cpu_run_on_one(nvme_tenant_release, data, CFG.cpu[fg->tid]))
+			log_err("nvme: failed to release tenant %ld\n", fg_handle);
+		return;
+	}
+
+	nvme_tenant_detach(&percpu_get(nvme_tenant_manager), fg);
+	free_local_nvme_swq(fg->nvme_swq);
+	recalculate_weights_remove(fg_handle);
+	nvme_fg_free_handle(fg_handle);
+}
+
+/*
+ * nvme_fg_rehash - moves a flow group to the key of another thread
+ *
+ * Submitters that see the new tid must also see migrating, so migrating is
+ * stored first.
+ */
+static void nvme_fg_rehash(struct nvme_flow_group *fg, unsigned int cpu, bool migrating)
+{
+	struct nvme_fg_bucket *from = nvme_fg_bucket(fg->flow_group_id, fg->tid);
+	struct nvme_fg_bucket *to = nvme_fg_bucket(fg->flow_group_id, cpu);
+	struct nvme_fg_bucket *first = from < to ? from : to;
+	struct nvme_fg_bucket *second = from < to ? to : from;
+
+	// in address order, another rehash may take the same two locks
+	spin_lock(&first->lock);
+	if (second != first)
+		spin_lock(&second->lock);
+
+	hlist_del(&fg->link);
+	hlist_add_head(&to->head, &fg->link);
+	*(volatile bool *) &fg->migrating = migrating;
+	*(volatile unsigned int *) &fg->tid = cpu;
+
+	if (second != first)
+		spin_unlock(&second->lock);
+	spin_unlock(&first->lock);
+}
+
+/*
+ * nvme_tenant_conn_fgs - finds the TCP flow groups of a tenant's connections
+ * @fg_handle: the tenant
+ * @fg_bitmap: set to the flow groups
+ *
+ * Returns true if the tenant can move with them: they hold every connection
+ * of the tenant and no other tenant's, and this thread owns them.
+ */
+static bool nvme_tenant_conn_fgs(long fg_handle, bitmap_ptr fg_bitmap)
+{
+	int i, conns = 0;
+
+	bitmap_init(fg_bitmap, ETH_MAX_TOTAL_FG, 0);
+	for (i = 0; i < ETH_MAX_TOTAL_FG; i++) {
+		if (nvme_eth_fgs[i].fg_handle != fg_handle)
+			continue;
+		if (!fgs[i] || fgs[i]->in_transition ||
+		    fgs[i]->cur_cpu != percpu_get(cpu_id))
+			return false;
+		bitmap_set(fg_bitmap, i);
+		conns += nvme_eth_fgs[i].conns;
+	}
+
+	return conns && conns == nvme_fgs[fg_handle].conn_ref_count;
+}
+
+/*
+ * Moving flow groups waits for a quiescent point of the thread, like
+ * CP_CMD_MIGRATE, so a move stays pending until then.
+ */
+struct nvme_tenant_move {
+	long fg_handle;				// 0 if none is pending
+	unsigned int cpu;
+};
+
+static DEFINE_PERCPU(struct nvme_tenant_move, nvme_tenant_move);
+
+/**
+ * nvme_tenant_migrate - moves a tenant and its connections to another thread
+ * @fg_handle: the tenant's flow group handle
+ * @cpu: the target thread (cpu_nr)
+ *
+ * Must be called on the thread currently scheduling the tenant, and needs
+ * tenant_rebalance, which tracks the flow groups of the connections. The
+ * move is carried out by nvme_tenant_move_conns().
+ *
+ * Returns 0 if successful, otherwise fail.
+ */
+int nvme_tenant_migrate(long fg_handle, unsigned int cpu)
+{
+	struct nvme_tenant_move *m = &percpu_get(nvme_tenant_move);
+	DEFINE_BITMAP(fg_bitmap, ETH_MAX_TOTAL_FG);
+	struct nvme_flow_group *fg;
+	unsigned int self = percpu_get(cpu_nr);
+
+	if (!nvme_rebalance_flag || fg_handle <= 0 || fg_handle >= MAX_NVME_FLOW_GROUPS ||
+	    cpu >= (unsigned int) cpus_active)
+		return -RET_INVAL;
+
+	fg = &nvme_fgs[fg_handle];
+	if (fg->tid != self || fg->migrating || !fg->conn_ref_count)
+		return -RET_INVAL;
+	if (cpu == self)
+		return 0;
+	if (m->fg_handle)
+		return -RET_AGAIN;
+	if (!nvme_tenant_conn_fgs(fg_handle, fg_bitmap))
+		return -RET_NOTSUP;
+
+	m->fg_handle = fg_handle;
+	m->cpu = cpu;
+	return 0;
+}
+
+/**
+ * nvme_tenant_move_conns - carries out the pending tenant move, if any
+ *
+ * Must be called at a quiescent point, with no events pending for the
+ * application. The software queue moves first, so requests the application
+ * still submits here are handed over, then the flow groups follow.
+ */
+void nvme_tenant_move_conns(void)
+{
+	struct nvme_tenant_mgmt *mgr = &percpu_get(nvme_tenant_manager);
+	struct nvme_tenant_move *m = &percpu_get(nvme_tenant_move);
+	DEFINE_BITMAP(fg_bitmap, ETH_MAX_TOTAL_FG);
+	struct nvme_flow_group *fg;
+	unsigned int self = percpu_get(cpu_nr);
+	long fg_handle = m->fg_handle;
+
+	// eth_fg_assign_to_cpu() handles one migration at a time
+	if (!fg_handle || eth_fg_migration_busy(m->cpu))
+		return;
+	m->fg_handle = 0;
+
+	// connections may have come and gone since the move was picked
+	fg = &nvme_fgs[fg_handle];
+	if (fg->tid != self || fg->migrating || !nvme_tenant_conn_fgs(fg_handle, fg_bitmap))
+		return;
+
+	/*
+	 * The tenant's connections all live on this thread, so its last one
+	 * can't be unregistered meanwhile.
+	 */
+	nvme_tenant_detach(mgr, fg);
+	nvme_fg_rehash(fg, m->cpu, true);
+
+	if (cpu_run_on_one(nvme_tenant_adopt, (void *) fg_handle, CFG.cpu[m->cpu])) {
+		nvme_fg_rehash(fg, self, false);
+		nvme_tenant_attach(mgr, fg);
+		log_err("nvme: can't migrate tenant %ld\n", fg_handle);
+		return;
+	}
+
+	eth_fg_assign_to_cpu(fg_bitmap, m->cpu);
+	log_info("Migrate tenant %ld and its connections from thread %u to thread %u\n",
+		 fg_handle, self, m->cpu);
+}
+
+/*
+ * nvme_rebalance_fits - can @swq move to a thread with load @min_load?
+ *
+ * It can if its load fits in half the gap between the two threads, so the
+ * move narrows the imbalance without reversing it, and its connections can
+ * move with it.
+ */
+static bool nvme_rebalance_fits(struct nvme_sw_queue *swq, unsigned long load,
+								unsigned long min_load)
+{
+	DEFINE_BITMAP(fg_bitmap, ETH_MAX_TOTAL_FG);
+
+	return swq->load && swq->load <= (load - min_load) / 2 &&
+	       nvme_tenant_conn_fgs(swq->fg_handle, fg_bitmap);
+}
+
+static void nvme_rebalance_interval(struct nvme_sw_queue *swq, unsigned long *load)
+{
+	swq->load = (swq->load + swq->sched_tokens) / 2;
+	swq->sched_tokens = 0;
+	*load += swq->load;
+}
+
+/*
+ * nvme_rebalance - hand a tenant to the least loaded thread if this one is
+ * overloaded
+ * @now: the current TSC
+ *
+ * Picks the busiest tenant that nvme_rebalance_fits().
+ */
+static void nvme_rebalance(unsigned long now)
+{
+	struct nvme_tenant_mgmt *mgr = &percpu_get(nvme_tenant_manager);
+	struct nvme_sw_queue *swq, *victim = NULL;
+	unsigned int self = percpu_get(cpu_nr);
+	unsigned int i, target = self;
+	unsigned long load = 0, sum = 0, min_load;
+
+	if (now - percpu_get(last_rebalance_tsc) < (unsigned long) NVME_REBALANCE_MS * 1000 * cycles_per_us)
+		return;
+	percpu_get(last_rebalance_tsc) = now;
+
+	list_for_each(&mgr->lc_swq, swq, list)
+		nvme_rebalance_interval(swq, &load);
+	list_for_each(&mgr->be_swq, swq, list)
+		nvme_rebalance_interval(swq, &load);
+	nvme_core_load[self].load = load;
+
+	if (percpu_get(rebalance_cooldown) > 0) {
+		percpu_get(rebalance_cooldown)--;
+		return;
+	}
+	if (mgr->num_tenants < 2)
+		return;
+
+	min_load = load;
+	for (i = 0; i < (unsigned int) cpus_active; i++) {
+		sum += nvme_core_load[i].load;
+		if (nvme_core_load[i].load < min_load) {
+			min_load = nvme_core_load[i].load;
+			target = i;
+		}
+	}
+	if (target == self || load * cpus_active * 100 <= sum * (100 + NVME_REBALANCE_IMBALANCE))
+		return;
+
+	list_for_each(&mgr->lc_swq, swq, list) {
+		if ((!victim || swq->load > victim->load) && nvme_rebalance_fits(swq, load, min_load))
+			victim = swq;
+	}
+	list_for_each(&mgr->be_swq, swq, list) {
+		if ((!victim || swq->load > victim->load) && nvme_rebalance_fits(swq, load, min_load))
+			victim = swq;
+	}
+	if (victim && !nvme_tenant_migrate(victim->fg_handle, target))
+		percpu_get(rebalance_cooldown) = NVME_REBALANCE_COOLDOWN;
+}
+
+static inline struct nvme_token_pool *nvme_local_socket_pool(void)
+{
+	return &nvme_socket_pool[percpu_get(cpu_numa_node) % NVME_MAX_SOCKETS];
+}
+
+/*
+ * nvme_pool_take - take up to @want tokens from a shared pool
+ *
+ * One fetch_and_sub in the common case; if the pool held less than @want,
+ * the shortfall is added back.
+ */
+static unsigned long nvme_pool_take(struct nvme_token_pool *pool, unsigned long want)
+{
+	long avail;
+
+	if (atomic64_read(&pool->tokens) <= 0)
+		return 0;
+
+	avail = atomic64_fetch_and_sub(&pool->tokens, want);
+	if (avail >= (long) want)
+		return want;
+
+	avail = max(avail, 0L);
+	atomic64_fetch_and_add(&pool->tokens, want - avail);
+	return avail;
+}
+
+/*
+ * nvme_tokens_give - donate spare tokens, spilling up the hierarchy only when
+ * the local bucket holds more than two batches
+ */
+static void nvme_tokens_give(unsigned long tokens)
+{
+	unsigned long *local = &percpu_get(local_token_bucket);
+	struct nvme_token_pool *socket;
+	unsigned long spill;
+	long level;
+
+	*local += tokens;
+	if (*local <= 2 * nvme_token_batch)
+		return;
+
+	// keep one batch for this core, push the rest to the socket
+	spill = *local - nvme_token_batch;
+	*local = nvme_token_batch;
+	socket = nvme_local_socket_pool();
+	level = atomic64_add_and_fetch(&socket->tokens, spill);
+	if (level <= (long) (NVME_SOCKET_POOL_BATCHES * nvme_token_batch))
+		return;
+
+	// socket overflows: move half of its capacity to the global pool
+	spill = nvme_pool_take(socket, NVME_SOCKET_POOL_BATCHES / 2 * nvme_token_batch);
+	if (spill)
+		atomic64_fetch_and_add(&nvme_global_pool.tokens, spill);
+}
+
+/*
+ * nvme_tokens_take - get up to @demand spare tokens, refilling the local
+ * bucket by at least a batch from the socket pool, then the global pool
+ */
+static unsigned long nvme_tokens_take(unsigned long demand)
+{
+	unsigned long *local = &percpu_get(local_token_bucket);
+	unsigned long want, got;
+
+	if (*local < demand) {
+		want = max(demand - *local, nvme_token_batch);
+		got = nvme_pool_take(nvme_local_socket_pool(), want);
+		if (got < want)
+			got += nvme_pool_take(&nvme_global_pool, want - got);
+		*local += got;
+	}
+
+	got = min(*local, demand);
+	*local -= got;
+	return got;
+}
+
+/*
+ * nvme_pool_expire - drop the tokens that have sat in a pool for a whole epoch
+ *
+ * Tokens donated during the epoch that just ended survive until the next
+ * one ends, so a core that donated right before the epoch ended doesn't
+ * lose its tokens to the reset.
+ */
+static void nvme_pool_expire(struct nvme_token_pool *pool)
+{
+	long level = atomic64_read(&pool->tokens);
+	long expire = min(pool->stale, level);
+
+	if (expire > 0) {
+		atomic64_fetch_and_sub(&pool->tokens, expire);
+		level -= expire;
+	}
+	pool->stale = max(level, 0L);
+}
+
+static void nvme_token_pools_expire(void)
+{
+	int i;
+
+	for (i = 0; i < NVME_MAX_SOCKETS; i++)
+		nvme_pool_expire(&nvme_socket_pool[i]);
+	nvme_pool_expire(&nvme_global_pool);
+}
+
+static inline void nvme_inflight_inc(void)
+{
+	percpu_get(nvme_outstanding)++;
+	atomic_inc(&nvme_dev_inflight);
+}
+
+static inline void nvme_inflight_dec(void)
+{
+	percpu_get(nvme_outstanding)--;
+	atomic_fetch_and_sub(&nvme_dev_inflight, 1);
+}
+
+static void nvme_qd_backoff(struct nvme_qd_governor *g)
+{
+	g->limit = max(g->limit * 3 / 4, NVME_QD_MIN);
+}
+
+/*
+ * nvme_qd_room - can the scheduler dispatch another request?
+ *
+ * Requests waiting in this thread's ready list for thieves count as
+ * outstanding here.
+ */
+static bool nvme_qd_room(void)
+{
+	struct nvme_qd_governor *g = &percpu_get(nvme_qd);
+
+	if (list_empty(&g->retry) &&
+	    percpu_get(nvme_outstanding) + nvme_steal_q[percpu_get(cpu_nr)].count < g->limit &&
+	    atomic_read(&nvme_dev_inflight) < NVME_DEV_QD_MAX)
+		return true;
+
+	g->limited = true;
+	return false;
+}
+
+/*
+ * nvme_qd_complete - account a completed command and adapt the limit
+ */
+static void nvme_qd_complete(struct nvme_ctx *ctx)
+{
+	struct nvme_qd_governor *g = &percpu_get(nvme_qd);
+	unsigned long target_us, avg;
+
+	nvme_inflight_dec();
+	if (!nvme_sched_flag)
+		return;
+
+	g->window_lat += rdtsc() - ctx->time;
+	if (++g->window_completions < NVME_QD_WINDOW)
+		return;
+
+	// keep the device well inside the strictest latency SLO
+	target_us = min(strictest_lc_latency_SLO() / 2, (unsigned int) NVME_QD_TARGET_US);
+	avg = g->window_lat / g->window_completions;
+	if (avg > target_us * cycles_per_us)
+		nvme_qd_backoff(g);
+	else if (g->limited)
+		g->limit = min(g->limit + 1, NVME_QD_MAX);
+
+	g->window_completions = 0;
+	g->window_lat = 0;
+	g->limited = false;
+}
+
+static void issue_nvme_req(struct nvme_ctx* ctx)
+{
+	int ret;
+
+	//don't schedule request on flash if FAKE_FLASH test	
+	if (nvme_dev_model == FAKE_FLASH) {
+		nvme_complete_req(ctx, RET_OK);
+		percpu_get(received_nvme_completions)++;
+
+		return; 
+	}
+
+	ctx->time = rdtsc();
+	nvme_inflight_inc();
+	if (ctx->cmd == NVME_CMD_READ) {
+		// if PRP:
+		//ret = spdk_nvme_ns_cmd_read(ctx->ns, percpu_get(qpair), ctx->paddr, ctx->lba, ctx->lba_count, nvme_read_cb, ctx, 0);
+		// for SGL:
+		ret = spdk_nvme_ns_cmd_readv(ctx->ns, percpu_get(qpair), ctx->lba, ctx->lba_count,
+									 nvme_read_cb, ctx, 0, sgl_reset_cb, sgl_next_cb);
 		
 	}
 	else if (ctx->cmd == NVME_CMD_WRITE) {
@@ -1238,84 +2917,225 @@ static void issue_nvme_req(struct nvme_ctx* ctx)
 		
 	}
 	else {
-		panic("unrecognized nvme request\n");
+		ret = nvme_submit_nodata(ctx);
+	}
+	if (ret == -ENOMEM) {
+		// the qpair is full: back off and resubmit once commands complete
+		nvme_inflight_dec();
+		list_add_tail(&percpu_get(nvme_qd).retry, &ctx->link);
+		nvme_qd_backoff(&percpu_get(nvme_qd));
+	}
+	else if (ret < 0) {
+		log_err("nvme: submission failed (%d)\n", ret);
+		nvme_inflight_dec();
+		nvme_complete_req(ctx, -RET_INVAL);
+	}
+}
+
+/*
+ * nvme_qd_retry - resubmit commands the qpair had no room for
+ */
+static void nvme_qd_retry(void)
+{
+	struct nvme_qd_governor *g = &percpu_get(nvme_qd);
+	struct nvme_ctx *ctx;
+	LIST_HEAD(retry);
+
+	list_append_list(&retry, &g->retry);
+	while (!list_empty(&retry)) {
+		ctx = list_pop(&retry, struct nvme_ctx, link);
+		issue_nvme_req(ctx);
+		// still full, keep the rest in order behind it
+		if (!list_empty(&g->retry)) {
+			list_append_list(&g->retry, &retry);
+			break;
+		}
+	}
+}
+
+/*
+ * nvme_sched_issue - submit a request the scheduler charged tokens for
+ *
+ * While this thread is loaded, the request waits in the ready list where
+ * idle threads can steal it; nvme_steal_flush() submits what is left.
+ */
+static void nvme_sched_issue(struct nvme_ctx *ctx)
+{
+	struct nvme_steal_queue *q;
+
+	if (!percpu_get(nvme_loaded)) {
+		issue_nvme_req(ctx);
+		return;
 	}
-	if (ret < 0) {
-		log_info("Ran out of NVMe cmd buffer space\n");
-		panic("Ran out of NVMe cmd buffer space\n");
+
+	q = &nvme_steal_q[percpu_get(cpu_nr)];
+	spin_lock(&q->lock);
+	list_add_tail(&q->ready, &ctx->link);
+	q->count++;
+	spin_unlock(&q->lock);
+}
+
+/*
+ * nvme_steal_flush - submit the ready requests no thread stole
+ */
+static void nvme_steal_flush(void)
+{
+	struct nvme_steal_queue *q = &nvme_steal_q[percpu_get(cpu_nr)];
+	struct nvme_ctx *ctx, *next;
+	LIST_HEAD(ready);
+
+	if (!q->count)
+		return;
+
+	spin_lock(&q->lock);
+	list_append_list(&ready, &q->ready);
+	q->count = 0;
+	spin_unlock(&q->lock);
+
+	list_for_each_safe(&ready, ctx, next, link)
+		issue_nvme_req(ctx);
+}
+
+/*
+ * nvme_steal - submit ready requests of loaded threads on this thread's qpair
+ */
+static void nvme_steal(void)
+{
+	struct nvme_ctx *batch[NVME_STEAL_BATCH];
+	struct nvme_steal_queue *q;
+	unsigned int self = percpu_get(cpu_nr);
+	int budget, i, j, n;
+
+	budget = percpu_get(nvme_qd).limit - percpu_get(nvme_outstanding);
+	for (i = 1; i < cpus_active && budget > 0; i++) {
+		q = &nvme_steal_q[(self + i) % cpus_active];
+		if (!q->count)
+			continue;
+
+		n = 0;
+		spin_lock(&q->lock);
+		while (n < min(budget, NVME_STEAL_BATCH) && !list_empty(&q->ready))
+			batch[n++] = list_pop(&q->ready, struct nvme_ctx, link);
+		q->count -= n;
+		spin_unlock(&q->lock);
+
+		for (j = 0; j < n; j++)
+			issue_nvme_req(batch[j]);
+		budget -= n;
 	}
 }
 
+/*
+ * lc_edf_sift_down - restore the deadline order of an LC dispatch heap
+ */
+static void lc_edf_sift_down(struct nvme_sw_queue **heap, int n, int pos)
+{
+	struct nvme_sw_queue *swq = heap[pos];
+	unsigned long key;
+	int child;
+
+	if (pos >= n)
+		return;
+
+	key = nvme_sw_queue_peak_head_deadline(swq);
+	while ((child = 2 * pos + 1) < n) {
+		if (child + 1 < n &&
+		    nvme_sw_queue_peak_head_deadline(heap[child + 1]) <
+		    nvme_sw_queue_peak_head_deadline(heap[child]))
+			child++;
+		if (nvme_sw_queue_peak_head_deadline(heap[child]) >= key)
+			break;
+		heap[pos] = heap[child];
+		pos = child;
+	}
+	heap[pos] = swq;
+}
 
 /*
  * nvme_sched_subround1: schedule latency critical tenant traffic 
+ * @time_delta: TSC cycles since the last scheduling round
  */
-static inline int nvme_sched_subround1(void)
+static inline int nvme_sched_subround1(unsigned long time_delta)
 {
 	struct nvme_tenant_mgmt* thread_tenant_manager;
 	struct nvme_sw_queue* nvme_swq;
 	struct nvme_ctx *ctx;
-	unsigned long now;
-	unsigned long time_delta;
 	long POS_LIMIT = 0;
+	long giveaway;
 	unsigned long local_leftover = 0;
 	unsigned long local_demand = 0;
-	double token_increment;
+	long token_increment;
+	unsigned long lc_boost_fp;
+	struct nvme_sw_queue **heap;
+	int nr_eligible = 0;
+	int i;
 
-	now = timer_now();	//in us
-	time_delta = now - percpu_get(last_sched_time);
-	percpu_get(last_sched_time) = now;
-	
 	thread_tenant_manager = &percpu_get(nvme_tenant_manager);
+	heap = thread_tenant_manager->lc_edf_heap;
+	// share of unreserved tokens per LC tenant (only when no BE tenants)
+	lc_boost_fp = atomic_u64_read(&global_lc_boost_fp);
 	
-	list_for_each(&thread_tenant_manager->tenant_swq, nvme_swq, list) {
-		// serve latency-critical (LC) tenants
-		if (nvme_fgs[nvme_swq->fg_handle].latency_critical_flag) {
-			if (nvme_swq->fg_handle == 2){
-				//log_info("%f\n", nvme_fgs[nvme_swq->fg_handle].scaled_IOPuS_limit);
-			}
-			
-			token_increment = (nvme_fgs[nvme_swq->fg_handle].scaled_IOPuS_limit * time_delta) + 0.5; // 0.5 is for rounding
-			nvme_swq->token_credit += (long) token_increment;
-			if (nvme_swq->token_credit < -TOKEN_DEFICIT_LIMIT){
-				/*
-				 * Notify control plane, may need to re-negotiate tenant SLO
-				 * FUTURE WORK: implement control plane
-				 */
-
-				//TODO: try to grab from global token bucket
-				//NOTE: may also need to schedule LC tenants in round robin for fairness
-			}
-			while (nvme_sw_queue_isempty(nvme_swq) == 0 && 
-				   nvme_swq->token_credit > -TOKEN_DEFICIT_LIMIT) {
-				nvme_sw_queue_pop_front(nvme_swq, &ctx); 
-				issue_nvme_req(ctx);
-				nvme_swq->token_credit -= ctx->req_cost;
-			}
-
+	// earn tokens, LC tenants with requests and credit left compete for dispatch
+	list_for_each(&thread_tenant_manager->lc_swq, nvme_swq, list) {
+		token_increment = nvme_tokens_earned(nvme_fgs[nvme_swq->fg_handle].token_rate_fp + lc_boost_fp,
+											 time_delta, &nvme_swq->token_frac);
+		nvme_swq->token_credit += token_increment;
+		nvme_swq->last_increment = token_increment;
+		if (nvme_swq->token_credit < -TOKEN_DEFICIT_LIMIT){
 			/*
-			 * POS_LIMIT can be tuned to balance work-conservation and favoring of LC traffic
-			 *	  * default POS_LIMIT    = 3 * token_increment
-			 *	  						if LC tenant doesn't use tokens accumulated 
-			 *	  						from ~3 sched rounds, donate them
-			 *	  						
-			 *   * lower POS_LIMIT 		is good for work-conservation 
-			 *   						(give tokens to BE tenants more easily)
-			 *   
-			 *   * higher POS_LIMIT 	allows latency-critical tenants to accumulate 
-			 *     						more tokens & burst
+			 * Notify control plane, may need to re-negotiate tenant SLO
+			 * FUTURE WORK: implement control plane
 			 */
-			POS_LIMIT = 3 * token_increment;
-			if (nvme_swq->token_credit > POS_LIMIT) {
-				local_leftover += (nvme_swq->token_credit * TOKEN_FRAC_GIVEAWAY);	
-				nvme_swq->token_credit -= nvme_swq->token_credit * TOKEN_FRAC_GIVEAWAY; 
-			}
+
+			//TODO: try to grab from global token bucket
 		}
-		else { // track demand of best-effort (will need for subround2)
-			local_demand += nvme_swq->total_token_demand - nvme_swq->saved_tokens;
+		if (nvme_sw_queue_isempty(nvme_swq) == 0 && 
+			nvme_swq->token_credit > -TOKEN_DEFICIT_LIMIT &&
+			nr_eligible < thread_tenant_manager->lc_edf_cap)
+			heap[nr_eligible++] = nvme_swq;
+	}
+
+	// serve latency-critical (LC) tenants earliest deadline first
+	for (i = nr_eligible / 2 - 1; i >= 0; i--)
+		lc_edf_sift_down(heap, nr_eligible, i);
+	while (nr_eligible && nvme_qd_room()) {
+		nvme_swq = heap[0];
+		nvme_sw_queue_pop_front(nvme_swq, &ctx); 
+		nvme_sched_issue(ctx);
+		nvme_swq->token_credit -= ctx->req_cost;
+		nvme_swq->sched_tokens += ctx->req_cost;
+		if (nvme_sw_queue_isempty(nvme_swq) ||
+			nvme_swq->token_credit <= -TOKEN_DEFICIT_LIMIT)
+			heap[0] = heap[--nr_eligible];
+		lc_edf_sift_down(heap, nr_eligible, 0);
+	}
+
+	list_for_each(&thread_tenant_manager->lc_swq, nvme_swq, list) {
+		/*
+		 * POS_LIMIT can be tuned to balance work-conservation and favoring of LC traffic
+		 *	  * default POS_LIMIT    = 3 * token_increment
+		 *	  						if LC tenant doesn't use tokens accumulated 
+		 *	  						from ~3 sched rounds, donate them
+		 *	  						
+		 *   * lower POS_LIMIT 		is good for work-conservation 
+		 *   						(give tokens to BE tenants more easily)
+		 *   
+		 *   * higher POS_LIMIT 	allows latency-critical tenants to accumulate 
+		 *     						more tokens & burst
+		 */
+		POS_LIMIT = 3 * nvme_swq->last_increment;
+		if (nvme_swq->token_credit > POS_LIMIT) {
+			giveaway = nvme_swq->token_credit * TOKEN_GIVEAWAY_NUM / TOKEN_GIVEAWAY_DEN;
+			local_leftover += giveaway;
+			nvme_swq->token_credit -= giveaway; 
 		}
 	}
 
+	// track demand of backlogged best-effort tenants (will need for subround2)
+	list_for_each(&thread_tenant_manager->be_active, nvme_swq, active_link) {
+		local_demand += nvme_swq->total_token_demand - nvme_swq->saved_tokens;
+	}
+
 	
 	percpu_get(local_extra_demand) = local_demand;
 	percpu_get(local_leftover_tokens) = local_leftover;
@@ -1327,152 +3147,125 @@ static inline int nvme_sched_subround1(void)
 
 /*
  * nvme_sched_subround2: schedule best-effort tenant traffic 
+ * @time_delta: TSC cycles since the last scheduling round
  */
-static inline void nvme_sched_subround2(void)
+static inline void nvme_sched_subround2(unsigned long time_delta)
 {
 	struct nvme_tenant_mgmt* thread_tenant_manager;
-	struct nvme_sw_queue* nvme_swq;
+	struct nvme_sw_queue *nvme_swq, *next;
 	struct nvme_ctx *ctx;
-	int i;
+	unsigned long active_weight, weight;
+	unsigned long quantum;
 	unsigned long local_leftover = 0;
 	unsigned long local_demand = 0;
 	unsigned long be_tokens = 0;
-	double token_increment = 0;
+	unsigned long be_earned;
 	unsigned long token_demand = 0;
-	unsigned long global_tokens_acquired = 0;
-	unsigned long now;
-	unsigned long time_delta_cycles;
+	unsigned long pool_tokens_acquired = 0;
 
 
 	local_leftover = percpu_get(local_leftover_tokens); 
 	local_demand = percpu_get(local_extra_demand);
 
 	thread_tenant_manager = &percpu_get(nvme_tenant_manager);
+
+	// every BE tenant earns its weighted share, idle ones donate it to the pool
+	be_earned = nvme_tokens_earned(atomic_u64_read(&global_be_rate_per_weight_fp) * thread_tenant_manager->be_weight_sum,
+								   time_delta, &percpu_get(be_token_frac));
 	
 	// compare local leftover with local demand 
 	// synchronize access to global token bucket
 	if (local_leftover > 0 && local_demand == 0) { //give away leftoever tokens to global pool
-		atomic_u64_fetch_and_add(&global_leftover_tokens, local_leftover);
+		nvme_tokens_give(local_leftover + be_earned);
 		return;
 	}
-	else if (local_leftover < local_demand) { //try to get how much you need from global pool
+	else if (local_leftover < local_demand) { //try to get how much you need from the token pools
 		token_demand = local_demand - local_leftover;
-		global_tokens_acquired = try_acquire_global_tokens(token_demand); // atomic 
-		be_tokens = local_leftover + global_tokens_acquired;
+		pool_tokens_acquired = nvme_tokens_take(token_demand);
+		be_tokens = local_leftover + pool_tokens_acquired;
 	}
 	else if (local_leftover >= local_demand) {
 		be_tokens = local_leftover;
 	}
 
-	now = rdtsc();	
-	time_delta_cycles = now - percpu_get(last_sched_time_be);
-	percpu_get(last_sched_time_be) = now; 
+	be_tokens += be_earned;
 
-	// serve best effort tenants in round-robin order
-	// TODO: simplify by implementing separate per-thread lists of BE and LC tenants
-	i = 0 ; 
-	list_for_each(&thread_tenant_manager->tenant_swq, nvme_swq, list) {
-		if (i < percpu_get(roundrobin_start)){
-			i++;
-			continue;
+	/*
+	 * Weighted deficit round-robin over backlogged BE tenants: each one gets
+	 * its weight's share of the tokens still in the pool on top of its saved
+	 * deficit, and tokens a tenant can't use flow on to the tenants after it.
+	 */
+	active_weight = 0;
+	list_for_each(&thread_tenant_manager->be_active, nvme_swq, active_link)
+		active_weight += nvme_fgs[nvme_swq->fg_handle].be_weight;
+
+	list_for_each_safe(&thread_tenant_manager->be_active, nvme_swq, next, active_link) {
+		weight = nvme_fgs[nvme_swq->fg_handle].be_weight;
+		quantum = be_tokens * weight / active_weight;
+		active_weight -= weight;
+		be_tokens -= quantum;
+		quantum += nvme_sw_queue_take_saved_tokens(nvme_swq); 
+				
+		while ( (nvme_sw_queue_isempty(nvme_swq) == 0) && 
+				nvme_sw_queue_peak_head_cost(nvme_swq) <= quantum &&
+				nvme_qd_room()) {
+			nvme_sw_queue_pop_front(nvme_swq, &ctx); 
+			nvme_sched_issue(ctx);
+			quantum -= ctx->req_cost;
+			nvme_swq->sched_tokens += ctx->req_cost;
 		}
-		if (!nvme_fgs[nvme_swq->fg_handle].latency_critical_flag){ 
-			be_tokens += nvme_sw_queue_take_saved_tokens(nvme_swq); 
-			token_increment = (atomic_read(&global_be_token_rate_per_tenant) * time_delta_cycles) / (double) (cycles_per_us * 1E6);
-			be_tokens += (long) (token_increment + 0.5);
-					
-			while ( (nvme_sw_queue_isempty(nvme_swq) == 0) && 
-					nvme_sw_queue_peak_head_cost(nvme_swq) <= be_tokens) {
-				nvme_sw_queue_pop_front(nvme_swq, &ctx); 
-				issue_nvme_req(ctx);
-				be_tokens -= ctx->req_cost;
-			}
-			//save extra tokens for this tenant if still has demand
-			be_tokens -= nvme_sw_queue_save_tokens(nvme_swq, be_tokens);
-			assert(be_tokens >= 0);
+		//save extra tokens for this tenant if still has demand
+		quantum -= nvme_sw_queue_save_tokens(nvme_swq, quantum);
+		be_tokens += quantum;
+
+		if (nvme_sw_queue_isempty(nvme_swq)) {
+			list_del(&nvme_swq->active_link);
+			nvme_swq->active = false;
 		}
-		i++;
 	}
-	
-	int j = 0;
-	list_for_each(&thread_tenant_manager->tenant_swq, nvme_swq, list) {
-		if (j >= percpu_get(roundrobin_start)){
-			break;
-		}
-		log_debug("schedule tenant second %d\n", j);
-		log_debug("subround2: sched tenant handle %ld, tenant_tokens %lu\n", nvme_swq->fg_handle, tenant_tokens);
-		if (!nvme_fgs[nvme_swq->fg_handle].latency_critical_flag){		
-			be_tokens += nvme_sw_queue_take_saved_tokens(nvme_swq); 
-			token_increment = (atomic_read(&global_be_token_rate_per_tenant) * time_delta_cycles) / (double) (cycles_per_us * 1E6);
-			be_tokens += (long) (token_increment + 0.5);
-			
-			while ( (nvme_sw_queue_isempty(nvme_swq) == 0) && 
-					nvme_sw_queue_peak_head_cost(nvme_swq) <= be_tokens) { 
-				nvme_sw_queue_pop_front(nvme_swq, &ctx); 
-				issue_nvme_req(ctx);
-				be_tokens -= ctx->req_cost; 
-			}
-			//save extra tokens for this tenant if still has demand
-			be_tokens -= nvme_sw_queue_save_tokens(nvme_swq, be_tokens);
-			assert(be_tokens >= 0);
-		}
-		j++;
-	}
-
-	int done = 0;
-	if (thread_tenant_manager->num_best_effort_tenants > 0){
-		while (1) { //find next round-robin start and check it's a best-effort tenant (otherwise unfair)
-			percpu_get(roundrobin_start) = (percpu_get(roundrobin_start) + 1) % thread_tenant_manager->num_tenants;
-			i = 0;
-			list_for_each(&thread_tenant_manager->tenant_swq, nvme_swq, list) {
-				if (i != percpu_get(roundrobin_start)){
-					i++;
-					continue;
-				}
-				if (!nvme_fgs[nvme_swq->fg_handle].latency_critical_flag){		
-					done = 1; //incremented to next best effort tenant
-				}
-				break;
-			}
-			if (done == 1) { 
-				break;
-			}
-		}
+
+	// rotate the ring so a different tenant gets the first share next round
+	if (!list_empty(&thread_tenant_manager->be_active)) {
+		nvme_swq = list_pop(&thread_tenant_manager->be_active, struct nvme_sw_queue, active_link);
+		list_add_tail(&thread_tenant_manager->be_active, &nvme_swq->active_link);
 	}
 	
 	if (be_tokens > 0){
-		atomic_u64_fetch_and_add(&global_leftover_tokens, be_tokens);
+		nvme_tokens_give(be_tokens);
 	}
 
 }
 
 /*
- * update_scheduler_bitvector: 
- * 		- synchronizes clearing of the global token bucket to limit global BE token accumulation
- * 		- mark global bitvector to indicate this thread has completed a scheduling round
- * 		- if last thread to complete a round, clear the global vector
- * 		- updates to global vector are not atomic operations because want to limit perf overhead
- * 		  and the exact timing of token bucket reset is not critical, as long as we reset approximately
- * 		  after each thread has had a chance to get tokens  
- */
-static void update_scheduled_bitvector(void){
-	
-	int i;
-	scheduled_bit_vector[percpu_get(cpu_nr)]++;
+ * nvme_sched_epoch_round - count this core's scheduling round in the epoch
+ *
+ * Limits how long spare BE tokens can accumulate in the shared pools: once
+ * every active core has had a round in the current epoch, the last core to
+ * finish ends the epoch and expires stale pool tokens. In the common case
+ * this is one read of a shared word; each core writes it once per epoch.
+ */
+static void nvme_sched_epoch_round(void)
+{
+	unsigned long word, epoch, new_word;
+
+	while (true) {
+		word = atomic_u64_read(&nvme_token_epoch.word);
+		epoch = word >> NVME_EPOCH_SHIFT;
+		if (epoch == percpu_get(sched_epoch))
+			return;
 
-	for (i = 0; i < cpus_active; i++){
-		if (scheduled_bit_vector[i] == 0)
+		if ((word & NVME_EPOCH_MASK) + 1 >= (unsigned long) cpus_active)
+			new_word = (epoch + 1) << NVME_EPOCH_SHIFT;
+		else
+			new_word = word + 1;
+
+		if (atomic_u64_cmpxchg(&nvme_token_epoch.word, word, new_word))
 			break;
 	}
-	if (i == cpus_active){ // all other threads scheduled at least once
-		atomic_u64_write(&global_leftover_tokens, 0);
-		
-		//clear scheduled bit vector
-		for (i = 0; i < cpus_active; i++) {
-			scheduled_bit_vector[i] =  0;
-		}
-	}
-	
+
+	percpu_get(sched_epoch) = epoch;
+	if (!(new_word & NVME_EPOCH_MASK))
+		nvme_token_pools_expire();
 }
 
 int nvme_sched(void)
@@ -1481,30 +3274,53 @@ int nvme_sched(void)
 	return 0;
 #endif
 	struct nvme_tenant_mgmt* thread_tenant_manager;
+	unsigned long now, time_delta;
+
 	thread_tenant_manager = &percpu_get(nvme_tenant_manager);
+
+	// one TSC time base for both subrounds
+	now = rdtsc();
+	time_delta = now - percpu_get(last_sched_tsc);
+	percpu_get(last_sched_tsc) = now;
+
+	nvme_handoff_drain_reqs();
+	if (nvme_rebalance_flag)
+		nvme_rebalance(now);
+
+	if (nvme_steal_flag) {
+		percpu_get(nvme_loaded) = time_delta > (unsigned long) NVME_STEAL_LOOP_US * cycles_per_us;
+		if (!percpu_get(nvme_loaded))
+			nvme_steal();
+	}
 	
 	if (thread_tenant_manager->num_tenants == 0) { 
-		percpu_get(last_sched_time) = timer_now();
-		percpu_get(last_sched_time_be) = rdtsc();
-		update_scheduled_bitvector(); 
+		nvme_sched_epoch_round();
 		return 0;
 	}
 
-	nvme_sched_subround1(); // serve latency-critical tenants
-	nvme_sched_subround2(); // serve best-effort tenants
+	nvme_sched_subround1(time_delta); // serve latency-critical tenants
+	nvme_sched_subround2(time_delta); // serve best-effort tenants
 	
 	percpu_get(local_leftover_tokens) = 0;
 	percpu_get(local_extra_demand) = 0;
 
-	update_scheduled_bitvector(); 
+	nvme_sched_epoch_round();
 
 	return 0;
 }
 
+/*
+ * The completion polling budget follows the network batch size: it doubles
+ * while polls drain as many completions as allowed and halves when they come
+ * back mostly empty, so one loop iteration does a bounded amount of NVMe work.
+ */
+#define NVME_POLL_BUDGET_MAX	4096
+
 void nvme_process_completions()
 {
 	int i;
-	int max_completions = 4096;
+	int budget = percpu_get(nvme_poll_budget);
+	int completed;
 
 	if (CFG.num_nvmedev == 0)
 		return;
@@ -1514,7 +3330,386 @@ void nvme_process_completions()
 		percpu_get(received_nvme_completions)++;
 	}
 	percpu_get(open_ev_ptr) = 0;
-	percpu_get(received_nvme_completions) +=
-		spdk_nvme_qpair_process_completions(percpu_get(qpair),
-						    max_completions);
+	completed = spdk_nvme_qpair_process_completions(percpu_get(qpair), budget);
+	if (completed > 0)
+		percpu_get(received_nvme_completions) += completed;
+
+	if (completed >= budget)
+		percpu_get(nvme_poll_budget) = min(2 * budget, NVME_POLL_BUDGET_MAX);
+	else if (completed < budget / 4)
+		percpu_get(nvme_poll_budget) = max(budget / 2, (int) eth_rx_max_batch);
+
+	nvme_handoff_drain_done();
+	nvme_qd_retry();
+	nvme_steal_flush();
+
+	if (nvme_devmodel_online)
+		nvme_devmodel_tick();
+}
+
+/*
+ * Device profiling
+ *
+ * Automates the procedure described in sample.devmodel: drive the device
+ * from this thread through issue_nvme_req with synthetic read/write mixes and
+ * request sizes, sweep the offered load from idle to saturation while
+ * measuring p95 read latency, fit the write cost and size scaling, and write
+ * out a devmodel file with the token limits for a range of latency SLOs.
+ *
+ * The read cost of a 4KB request is fixed at 100 tokens, other costs are
+ * relative to it.
+ */
+#define PROF_READ_COST			100
+#define PROF_MAX_REQ_SIZE		(32 * 1024)
+#define PROF_MAX_QD				256		// outstanding requests at saturation
+#define PROF_STEPS				10		// load steps between idle and saturation
+#define PROF_STEP_MS			1000
+#define PROF_WARMUP_MS			100
+#define PROF_MAX_LAT_US			5000	// stop a sweep once p95 is past this
+
+struct nvme_prof_mix {
+	int read_pct;
+	int req_size;
+};
+
+struct nvme_prof_point {
+	double iops;							// reads + writes per second
+	unsigned int p95;						// p95 read latency in us
+};
+
+struct nvme_prof_curve {
+	const struct nvme_prof_mix *mix;
+	double sat_iops;						// closed-loop throughput at PROF_MAX_QD
+	int num_points;
+	struct nvme_prof_point points[PROF_STEPS];
+};
+
+static const struct nvme_prof_mix nvme_prof_mixes[] = {
+	{ 100, 4096 },		// read-only curve (max_rdonly_token_rate)
+	{  90, 4096 },		// mixed curves (write cost, max_token_rate)
+	{  75, 4096 },
+	{  50, 4096 },
+	{ 100, 8192 },		// size scaling
+	{ 100, 16384 },
+	{ 100, 32768 },
+};
+#define PROF_NUM_MIXES	(int) (sizeof(nvme_prof_mixes) / sizeof(nvme_prof_mixes[0]))
+#define PROF_NUM_MIXED	3	// nvme_prof_mixes[1..3]
+
+static const unsigned int nvme_prof_latencies[] = {
+	200, 300, 500, 750, 1000, 1500, 2000, 2500, 3000, 4000, 5000
+};
+#define PROF_NUM_LATENCIES	(int) (sizeof(nvme_prof_latencies) / sizeof(nvme_prof_latencies[0]))
+
+static struct spdk_nvme_ns *nvme_prof_ns;
+static void *nvme_prof_sgl[PROF_MAX_REQ_SIZE / SGL_PAGE_SIZE];
+static struct nvme_devmodel_window nvme_prof_stats;
+static int nvme_prof_outstanding;
+static unsigned long nvme_prof_seed = 88172645463325252UL;
+
+static unsigned long nvme_profile_rand(void)
+{
+	nvme_prof_seed ^= nvme_prof_seed << 13;
+	nvme_prof_seed ^= nvme_prof_seed >> 7;
+	nvme_prof_seed ^= nvme_prof_seed << 17;
+	return nvme_prof_seed;
+}
+
+static void nvme_profile_complete(struct nvme_ctx *ctx)
+{
+	// count requests rather than 4KB units
+	nvme_devmodel_account(&nvme_prof_stats, ctx, 1);
+	nvme_prof_outstanding--;
+	free_local_nvme_ctx(ctx);
+}
+
+static int nvme_profile_submit(const struct nvme_prof_mix *mix)
+{
+	struct nvme_ctx *ctx;
+	unsigned long num_slots = global_ns_size / mix->req_size;
+
+	ctx = alloc_local_nvme_ctx();
+	if (ctx == NULL)
+		return -RET_NOMEM;
+
+	ctx->cmd = (int) (nvme_profile_rand() % 100) < mix->read_pct ? NVME_CMD_READ : NVME_CMD_WRITE;
+	ctx->ns = nvme_prof_ns;
+	ctx->lba_count = mix->req_size / global_ns_sector_size;
+	ctx->lba = (nvme_profile_rand() % num_slots) * ctx->lba_count;
+	ctx->req_cost = nvme_compute_req_cost(ctx->cmd, mix->req_size);
+	ctx->user_buf.sgl_buf.sgl = nvme_prof_sgl;
+	ctx->user_buf.sgl_buf.num_sgls = mix->req_size / SGL_PAGE_SIZE;
+	ctx->user_buf.sgl_buf.current_sgl = 0;
+
+	nvme_prof_outstanding++;
+	issue_nvme_req(ctx);
+	return 0;
+}
+
+/*
+ * nvme_profile_step - offer @iops of @mix for one step (closed loop at
+ * PROF_MAX_QD if @iops is 0) and measure the result
+ */
+static void nvme_profile_step(const struct nvme_prof_mix *mix, double iops,
+							  struct nvme_prof_point *pt)
+{
+	unsigned long warmup = PROF_WARMUP_MS * 1000UL * cycles_per_us;
+	unsigned long duration = PROF_STEP_MS * 1000UL * cycles_per_us;
+	unsigned long gap = iops ? (unsigned long) (cycles_per_us * 1E6 / iops) : 0;
+	unsigned long start, now, next;
+	bool measuring = false;
+	double secs;
+
+	memset(&nvme_prof_stats, 0, sizeof(nvme_prof_stats));
+	start = next = rdtsc();
+	while ((now = rdtsc()) - start < warmup + duration) {
+		if (!measuring && now - start >= warmup) {
+			memset(&nvme_prof_stats, 0, sizeof(nvme_prof_stats));
+			nvme_prof_stats.start = now;
+			measuring = true;
+		}
+		while (nvme_prof_outstanding < PROF_MAX_QD && next <= now) {
+			if (nvme_profile_submit(mix))
+				break;
+			next += gap;
+		}
+		// an open loop that fell behind doesn't get to catch up in a burst
+		if (gap && next < now && now - next > PROF_MAX_QD * gap)
+			next = now;
+		spdk_nvme_qpair_process_completions(percpu_get(qpair), PROF_MAX_QD);
+		// submissions the qpair had no room for wait on the retry list
+		nvme_qd_retry();
+	}
+	secs = (now - nvme_prof_stats.start) / (cycles_per_us * 1E6);
+
+	while (nvme_prof_outstanding) {
+		spdk_nvme_qpair_process_completions(percpu_get(qpair), PROF_MAX_QD);
+		nvme_qd_retry();
+	}
+
+	pt->iops = (nvme_prof_stats.rd_units + nvme_prof_stats.wr_units) / secs;
+	pt->p95 = nvme_prof_stats.samples ? nvme_devmodel_p95(&nvme_prof_stats) : 0;
+}
+
+static void nvme_profile_mix(const struct nvme_prof_mix *mix, struct nvme_prof_curve *c)
+{
+	struct nvme_prof_point sat;
+	struct nvme_prof_point *pt;
+	int i;
+
+	nvme_profile_step(mix, 0, &sat);
+	c->mix = mix;
+	c->sat_iops = sat.iops;
+	c->num_points = 0;
+	log_info("profile: %d%% reads, %dB: saturates at %.0f IOPS, p95 %u us\n",
+			 mix->read_pct, mix->req_size, sat.iops, sat.p95);
+
+	for (i = 1; i <= PROF_STEPS; i++) {
+		pt = &c->points[c->num_points++];
+		nvme_profile_step(mix, sat.iops * i / PROF_STEPS, pt);
+		log_info("profile: %d%% reads, %dB: %.0f IOPS, p95 %u us\n",
+				 mix->read_pct, mix->req_size, pt->iops, pt->p95);
+		if (pt->p95 > PROF_MAX_LAT_US)
+			break;
+	}
+}
+
+/*
+ * nvme_profile_iops_at - highest IOPS of a curve whose p95 stays within @lat
+ *
+ * Returns -1 if even the lightest load exceeds @lat.
+ */
+static double nvme_profile_iops_at(struct nvme_prof_curve *c, unsigned int lat)
+{
+	struct nvme_prof_point *p0, *p1;
+	int i;
+
+	if (!c->num_points || c->points[0].p95 > lat)
+		return -1;
+
+	for (i = 1; i < c->num_points; i++) {
+		if (c->points[i].p95 > lat) {
+			p0 = &c->points[i-1];
+			p1 = &c->points[i];
+			return p0->iops + (p1->iops - p0->iops) * (lat - p0->p95) / (double) (p1->p95 - p0->p95);
+		}
+	}
+	return c->points[c->num_points - 1].iops;
+}
+
+/*
+ * nvme_profile_fit_write_cost - find the write weight that makes the mixed
+ * curves overlap: at each latency the mixes satisfy RdIOPS + w * WrIOPS = const,
+ * so w is minus the slope of read vs. write rate across the mixes
+ */
+static int nvme_profile_fit_write_cost(struct nvme_prof_curve *mixed)
+{
+	double rd[PROF_NUM_MIXED], wr[PROF_NUM_MIXED];
+	double mean_rd, mean_wr, var, cov, iops;
+	double weight_sum = 0;
+	int num_fits = 0;
+	int i, j, n;
+
+	for (i = 0; i < PROF_NUM_LATENCIES; i++) {
+		mean_rd = mean_wr = 0;
+		for (j = 0, n = 0; j < PROF_NUM_MIXED; j++) {
+			iops = nvme_profile_iops_at(&mixed[j], nvme_prof_latencies[i]);
+			if (iops < 0)
+				continue;
+			rd[n] = iops * mixed[j].mix->read_pct / 100;
+			wr[n] = iops - rd[n];
+			mean_rd += rd[n];
+			mean_wr += wr[n];
+			n++;
+		}
+		if (n < 2)
+			continue;
+		mean_rd /= n;
+		mean_wr /= n;
+
+		var = cov = 0;
+		for (j = 0; j < n; j++) {
+			var += (wr[j] - mean_wr) * (wr[j] - mean_wr);
+			cov += (wr[j] - mean_wr) * (rd[j] - mean_rd);
+		}
+		if (var <= 0 || cov >= 0)
+			continue;
+		weight_sum += -cov / var;
+		num_fits++;
+	}
+
+	if (!num_fits) {
+		log_warn("profile: could not fit write cost, using %d\n", NVME_WRITE_COST);
+		return NVME_WRITE_COST;
+	}
+	return max((int) (PROF_READ_COST * weight_sum / num_fits + 0.5), PROF_READ_COST);
+}
+
+static int nvme_profile_write_devmodel(const char *path, struct nvme_prof_curve *curves,
+									   int write_cost)
+{
+	struct nvme_prof_curve *rdonly = &curves[0];
+	struct nvme_prof_curve *mixed = &curves[1];
+	double rdonly_iops, iops, tokens, min_tokens, rd_frac, size_factor;
+	int i, j, n;
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (!f) {
+		log_err("profile: can't open %s\n", path);
+		return -EIO;
+	}
+
+	fprintf(f, "# Device model generated by ix --profile\n\n");
+	fprintf(f, "read_cost_4KB=%d\n", PROF_READ_COST);
+	fprintf(f, "write_cost_4KB=%d\n\n", write_cost);
+
+	// cost of a larger read relative to a 4KB read at the same latency
+	fprintf(f, "read_cost_by_size=(\n");
+	fprintf(f, "  { size = 4096; cost = %d; }", PROF_READ_COST);
+	for (i = 1 + PROF_NUM_MIXED; i < PROF_NUM_MIXES; i++) {
+		size_factor = 0;
+		for (j = 0, n = 0; j < PROF_NUM_LATENCIES; j++) {
+			rdonly_iops = nvme_profile_iops_at(rdonly, nvme_prof_latencies[j]);
+			iops = nvme_profile_iops_at(&curves[i], nvme_prof_latencies[j]);
+			if (rdonly_iops <= 0 || iops <= 0)
+				continue;
+			size_factor += rdonly_iops / iops;
+			n++;
+		}
+		if (n)
+			fprintf(f, ",\n  { size = %d; cost = %d; }", curves[i].mix->req_size,
+					(int) (PROF_READ_COST * size_factor / n + 0.5));
+	}
+	fprintf(f, "\n)\n\n");
+
+	fprintf(f, "max_token_rate=%lu\n\n", (unsigned long) (rdonly->sat_iops * PROF_READ_COST));
+
+	fprintf(f, "token_limits=(\n");
+	for (i = 0, n = 0; i < PROF_NUM_LATENCIES; i++) {
+		rdonly_iops = nvme_profile_iops_at(rdonly, nvme_prof_latencies[i]);
+		if (rdonly_iops < 0)
+			continue;
+
+		// a limit for mixed load has to hold for every mix
+		min_tokens = -1;
+		for (j = 0; j < PROF_NUM_MIXED; j++) {
+			iops = nvme_profile_iops_at(&mixed[j], nvme_prof_latencies[i]);
+			if (iops < 0)
+				break;
+			rd_frac = mixed[j].mix->read_pct / 100.0;
+			tokens = iops * (rd_frac * PROF_READ_COST + (1 - rd_frac) * write_cost);
+			if (min_tokens < 0 || tokens < min_tokens)
+				min_tokens = tokens;
+		}
+		if (j < PROF_NUM_MIXED)
+			continue;
+
+		fprintf(f, "%s  {\n", n++ ? ",\n" : "");
+		fprintf(f, "\tp95_latency_limit \t\t : %u \t#in us\n", nvme_prof_latencies[i]);
+		fprintf(f, "\tmax_token_rate \t\t\t : %lu\t#in tokens\n", (unsigned long) min_tokens);
+		fprintf(f, "\tmax_rdonly_token_rate \t : %lu\t#in tokens\n",
+				(unsigned long) (rdonly_iops * PROF_READ_COST));
+		fprintf(f, "  }");
+	}
+	fprintf(f, "\n)\n");
+	fclose(f);
+
+	if (!n)
+		log_warn("profile: no latency SLO in range, token_limits is empty\n");
+	return 0;
+}
+
+/**
+ * nvme_profile_device - profile the NVMe device and write a devmodel file
+ * @path: the devmodel file to write
+ *
+ * Runs on the calling thread before any tenant is admitted.
+ * WARNING: writes random data all over the namespace.
+ *
+ * Returns 0 if successful, otherwise failure.
+ */
+int nvme_profile_device(const char *path)
+{
+	struct nvme_prof_curve curves[PROF_NUM_MIXES];
+	void *buf;
+	int write_cost;
+	int i, ret;
+
+	if (CFG.num_nvmedev == 0 || !nvme_ctrlr) {
+		log_err("profile: no NVMe device\n");
+		return -ENODEV;
+	}
+
+	nvme_prof_ns = spdk_nvme_ctrlr_get_ns(nvme_ctrlr, global_ns_id);
+	global_ns_size = spdk_nvme_ns_get_size(nvme_prof_ns);
+	global_ns_sector_size = spdk_nvme_ns_get_sector_size(nvme_prof_ns);
+
+	buf = mem_alloc_page_local(PGSIZE_2MB);
+	if (!buf)
+		return -ENOMEM;
+	for (i = 0; i < PROF_MAX_REQ_SIZE / SGL_PAGE_SIZE; i++)
+		nvme_prof_sgl[i] = (char *) buf + i * SGL_PAGE_SIZE;
+
+	// requests must reach the device and come back to the profiler
+	nvme_dev_model = FLASH_DEV_MODEL;
+	nvme_devmodel_online = false;
+	NVME_READ_COST = PROF_READ_COST;
+	nvme_read_cost_curve.num_points = 0;
+	nvme_build_cost_table();
+	nvme_profiling = true;
+
+	for (i = 0; i < PROF_NUM_MIXES; i++)
+		nvme_profile_mix(&nvme_prof_mixes[i], &curves[i]);
+
+	nvme_profiling = false;
+	mem_free_page(buf, PGSIZE_2MB);
+
+	write_cost = nvme_profile_fit_write_cost(&curves[1]);
+	log_info("profile: write cost %d tokens\n", write_cost);
+
+	ret = nvme_profile_write_devmodel(path, curves, write_cost);
+	if (!ret)
+		log_info("profile: device model written to %s\n", path);
+	return ret;
 }
@@ -103,16 +103,31 @@ struct cfg_parameters {
 	uint16_t ports[CFG_MAX_PORTS];
 
 	char loader_path[256];
+	char nvme_profile_file[256];	// profile the NVMe device and write a devmodel here
 };
 
 extern struct cfg_parameters CFG;
 
 int nvme_dev_model;
 bool nvme_sched_flag;
+bool nvme_rebalance_flag;			// move tenants off cores with above-average scheduler load
+bool nvme_steal_flag;				// idle cores submit requests scheduled by loaded cores
+
+enum {
+	NVME_RW_TOKEN_FAIR = 0,			// alternate reads and writes by tokens served
+	NVME_RW_READ_PRIORITY,			// serve writes only when no reads are queued
+	NVME_RW_RATIO,					// serve nvme_rw_ratio reads per write
+};
+
+int nvme_rw_policy;					// how a tenant's read and write queues interleave
+int nvme_rw_ratio;
 
 
 int NVME_READ_COST;
 int NVME_WRITE_COST;
+int NVME_TRIM_COST;					// per deallocate command, independent of size
+int NVME_FLUSH_COST;
+int NVME_WRITE_ZEROES_COST;			// per 4KB zeroed
 unsigned long MAX_DEV_TOKEN_RATE;
 
 struct lat_tokenrate_pair{
@@ -124,5 +139,24 @@ struct lat_tokenrate_pair{
 struct lat_tokenrate_pair dev_model[128];
 int dev_model_size;
 
+#define NVME_MAX_COST_POINTS 16
+
+struct nvme_cost_point {
+	uint32_t size;					// request size in bytes
+	uint32_t cost;					// tokens charged for a request of this size
+};
+
+struct nvme_cost_curve {
+	int num_points;					// 0: cost scales linearly with 4KB units
+	struct nvme_cost_point points[NVME_MAX_COST_POINTS];
+};
+
+struct nvme_cost_curve nvme_read_cost_curve;
+struct nvme_cost_curve nvme_write_cost_curve;
+int nvme_seq_write_discount;		// % off the cost of a write that continues the tenant's last write
+
+bool nvme_devmodel_online;			// refine dev_model and write cost from measured latency
+int nvme_devmodel_interval_ms;		// length of a calibration window
+
 extern int cfg_init(int argc, char *argv[], int *args_parsed);
 
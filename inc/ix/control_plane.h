@@ -82,6 +82,7 @@ enum commands {
 	CP_CMD_NOP = 0,
 	CP_CMD_MIGRATE,
 	CP_CMD_IDLE,
+	CP_CMD_NVME_MIGRATE,
 };
 
 enum status {
@@ -101,6 +102,10 @@ struct command_struct {
 		struct {
 			char fifo[IDLE_FIFO_SIZE];
 		} idle;
+		struct {
+			long fg_handle;
+			int cpu;
+		} nvme_migrate;
 	};
 	char no_idle;
 };
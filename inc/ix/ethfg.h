@@ -158,6 +158,7 @@ extern void eth_fg_init(struct eth_fg *fg, unsigned int idx);
 extern int eth_fg_init_cpu(struct eth_fg *fg);
 extern void eth_fg_free(struct eth_fg *fg);
 extern void eth_fg_assign_to_cpu(bitmap_ptr fg_bitmap, int cpu);
+extern bool eth_fg_migration_busy(int cpu);
 
 extern int nr_flow_groups;
 
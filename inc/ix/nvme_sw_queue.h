@@ -33,33 +33,66 @@
  * Data structure for Flash SW queue scheduling
  * Lock-free and works for single producer, single consumer 
  *
+ * Reads and writes of a tenant wait in separate rings, so an expensive write
+ * at the head doesn't hold back the cheap reads behind it. The head of the
+ * queue is the head of the ring picked by the configured policy
+ * (nvme_rw_policy).
+ *
+ * Rings start with a few inline slots and double on demand up to
+ * NVME_SW_QUEUE_SIZE; past that, requests spill to a linked overflow list
+ * instead of being rejected. A grown ring keeps its slots until the tenant
+ * is destroyed, so a tenant with bursty backlog doesn't allocate on every
+ * burst.
 */
 
 #include <ix/nvmedev.h>
 #include <ix/list.h>
 
-#define NVME_SW_QUEUE_SIZE (256*8)  
+#define NVME_SW_QUEUE_SIZE (256*8)  	// max ring slots, power of two
+#define NVME_SW_RING_INLINE 16			// inline ring slots, power of two
 
-struct nvme_sw_queue
+#define NVME_SW_QUEUE_RD	0
+#define NVME_SW_QUEUE_WR	1
+
+struct nvme_sw_ring
 {
-    struct nvme_ctx* buf[NVME_SW_QUEUE_SIZE]; 
-	int count;				  // number of elements current in queue
+    struct nvme_ctx** buf; 			// inline_buf or a larger allocated array
+	unsigned int mask;				// slots - 1
+	int count;				  // number of elements current in ring
     unsigned int head;       // head index (insert here)
     unsigned int tail;       // tail index (remove from here)
+	struct list_head overflow;		// requests behind a full ring, in order
+	struct nvme_ctx* inline_buf[NVME_SW_RING_INLINE];
+};
+
+struct nvme_sw_queue
+{
+	struct nvme_sw_ring ring[2];	// [NVME_SW_QUEUE_RD or NVME_SW_QUEUE_WR]
+	int count;				  // number of elements current in queue
+	unsigned long served[2];		// tokens served per ring (token-fair policy)
+	int reads_in_row;				// reads served since the last write (ratio policy)
 	unsigned long total_token_demand;
 	unsigned long saved_tokens;
     long fg_handle;
 	long token_credit;
-	struct list_node list;
+	long last_increment;			// tokens earned in the last scheduling round
+	unsigned long token_frac;		// fixed-point remainder of earned tokens
+	unsigned long sched_tokens;		// tokens scheduled since the last rebalance check
+	unsigned long load;				// smoothed sched_tokens per rebalance interval
+	struct list_node list;			// entry in the thread's LC or BE tenant list
+	struct list_node active_link;	// entry in the thread's active BE ring
+	bool active;
 };
 
 
 
 void nvme_sw_queue_init(struct nvme_sw_queue *q, long fg_handle);
+void nvme_sw_queue_destroy(struct nvme_sw_queue *q);
 int nvme_sw_queue_push_back(struct nvme_sw_queue *q, struct nvme_ctx *ctx);
 int nvme_sw_queue_pop_front(struct nvme_sw_queue *q, struct nvme_ctx **ctx);
 int nvme_sw_queue_isempty(struct nvme_sw_queue *q);
 int nvme_sw_queue_peak_head_cost(struct nvme_sw_queue *q);
+unsigned long nvme_sw_queue_peak_head_deadline(struct nvme_sw_queue *q);
 unsigned long nvme_sw_queue_save_tokens(struct nvme_sw_queue *q, unsigned long tokens);
 unsigned long nvme_sw_queue_take_saved_tokens(struct nvme_sw_queue *q);
 
@@ -44,6 +44,9 @@
 
 #define NVME_CMD_READ 0
 #define NVME_CMD_WRITE 1
+#define NVME_CMD_TRIM 2					// dataset management, deallocate
+#define NVME_CMD_FLUSH 3
+#define NVME_CMD_WRITE_ZEROES 4
 
 
 #define NVME_MAX_COMPLETIONS 64
@@ -64,12 +67,13 @@ struct nvme_ctx {
 			int num_sgls;
 			int current_sgl;
 		} sgl_buf;
+		uint64_t dsm_range[2];		// struct spdk_nvme_dsm_range for NVME_CMD_TRIM
 	} user_buf;
 	// added for SW scheduling...
-	unsigned int tid; 				//thread id = percpu_get(cpu_nr)
+	unsigned int tid; 				//thread id = percpu_get(cpu_nr) of the submitting thread
 	//hqu_t priority;					//request priority (determined by flow priority)
 	hqu_t fg_handle;					//flow group handle 
-	int cmd; 						//NVME_CMD_[READ or WRITE]
+	int cmd; 						//NVME_CMD_[READ, WRITE, TRIM, FLUSH or WRITE_ZEROES]
 	int req_cost; 					//cost of request in tokens
 	// command arguments...
 	struct spdk_nvme_ns *ns;		//namespace
@@ -78,28 +82,41 @@ struct nvme_ctx {
 	unsigned int lba_count;			//size of IO in logical blocks
 	const struct nvme_completion* completion;	//callback function handle
 	unsigned long time;
+	unsigned long deadline;			//arrival TSC + tenant latency SLO
+	long status;					//completion status while handed to another thread
+	struct list_node link;			//entry in a handoff, ready, retry or swq overflow list
 };
 
 
 struct nvme_flow_group {
-	int flow_group_id;				// flow group id (index in bitmap)
+	long flow_group_id;				// flow group id picked by the application
 	//long ns_id; 					// namespace id
 	unsigned long cookie;			// cookie associated with connection context for user
 	unsigned int latency_us_SLO;	// latency SLO info (0 if best effort)
 	unsigned long IOPS_SLO;
 	int rw_ratio_SLO;
 	unsigned long scaled_IOPS_limit; // calculated based on IOPS, rw_ratio and rw cost
-	double scaled_IOPuS_limit; 		
+	unsigned long token_rate_fp;	// scaled_IOPS_limit in fixed-point tokens per TSC cycle
 	bool latency_critical_flag;
-	struct nvme_sw_queue* nvme_swq;	// thread-local software queue for this flow group
-	unsigned int tid; 				// thread id 
-	int conn_ref_count;
+	unsigned int be_weight;			// share of spare tokens relative to other BE tenants
+	unsigned long next_write_lba;	// lba right after the tenant's last write
+	struct nvme_sw_queue* nvme_swq;	// software queue, scheduled by thread tid
+	unsigned int tid; 				// thread id of the thread scheduling this flow group
+	bool migrating;					// swq is on its way to thread tid
+	int conn_ref_count;				// connections registered on any thread
+	int lc_heap_idx;				// position in the LC latency SLO heap
+	struct hlist_node link;			// entry in the flow group index
 };
 
 struct nvme_tenant_mgmt {
-	struct list_head tenant_swq;
+	struct list_head lc_swq;		// latency-critical tenants
+	struct list_head be_swq;		// best-effort tenants
+	struct list_head be_active;		// best-effort tenants with queued requests
 	int num_tenants;
 	int num_best_effort_tenants;
+	unsigned long be_weight_sum;	// sum of be_weight over this thread's BE tenants
+	struct nvme_sw_queue **lc_edf_heap;	// LC dispatch heap, grows with the LC tenants
+	int lc_edf_cap;
 };
 
 /*
@@ -121,4 +138,7 @@ extern void nvme_process_completions(void);
 extern bool nvme_poll_completions(int max_completions);
 extern int nvme_schedule(void);
 extern int nvme_sched(void);
+extern int nvme_tenant_migrate(long fg_handle, unsigned int cpu);
+extern void nvme_tenant_move_conns(void);
+extern int nvme_register_buf_region(void *vaddr, size_t len);
 
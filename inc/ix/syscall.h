@@ -225,6 +225,10 @@ enum {
 	KSYS_NVME_CLOSE,
 	KSYS_NVME_REGISTER_FLOW,
 	KSYS_NVME_UNREGISTER_FLOW,
+	KSYS_NVME_REGISTER_BUF,
+	KSYS_NVME_TRIM,
+	KSYS_NVME_WRITE_ZEROES,
+	KSYS_NVME_FLUSH,
 	KSYS_NR,
 };
 
@@ -464,24 +468,81 @@ ksys_nvme_readv(struct bsys_desc *d, hqu_t fg_handle, void **sgls, int num_sgls,
  * @latency_us_SLO: latency SLO (0 if not latency critical, ie if best-effort)
  * @IOPS_SLO: IOPS SLO (0 if not latency critical)
  * @rw_ratio_SLO: read write ratio corresponding to SLO above
+ * @be_weight: share of spare tokens relative to other best-effort tenants
+ * @handle: the TCP flow handle of the connection registering
+ *
+ * @rw_ratio_SLO and @be_weight share an argument, low and high 32 bits.
  */
 static inline void
 ksys_nvme_register_flow(struct bsys_desc *d, long flow_group_id, unsigned long cookie, 
 							 unsigned int latency_us_SLO, unsigned long IOPS_SLO, 
-							 int rw_ratio_SLO  )
+							 int rw_ratio_SLO, unsigned int be_weight, hid_t handle)
 {
-	BSYS_DESC_5ARG(d, KSYS_NVME_REGISTER_FLOW, flow_group_id, cookie, 
-				   latency_us_SLO, IOPS_SLO, rw_ratio_SLO); 
+	BSYS_DESC_6ARG(d, KSYS_NVME_REGISTER_FLOW, flow_group_id, cookie, 
+				   latency_us_SLO, IOPS_SLO, 
+				   ((unsigned long) be_weight << 32) | (unsigned int) rw_ratio_SLO,
+				   handle); 
 }
 
 /* ksys_nvme_unregister_flow - unregisters an nvme flow
  * @d: the syscal descriptor to program
  * @fg_handle: fg_handle for freed flow
+ * @handle: the TCP flow handle of the connection unregistering
+ */
+static inline void
+ksys_nvme_unregister_flow(struct bsys_desc *d, long fg_handle, hid_t handle)
+{
+	BSYS_DESC_2ARG(d, KSYS_NVME_UNREGISTER_FLOW, fg_handle, handle);
+}
+
+/* ksys_nvme_register_buf - pre-translates a buffer pool used for nvme I/O
+ * @d: the syscal descriptor to program
+ * @addr: the start of the pool (2MB aligned)
+ * @len: the length of the pool in bytes
+ */
+static inline void
+ksys_nvme_register_buf(struct bsys_desc *d, void *addr, unsigned long len)
+{
+	BSYS_DESC_2ARG(d, KSYS_NVME_REGISTER_BUF, addr, len);
+}
+
+/* ksys_nvme_trim - deallocates a range of blocks
+ * @d: the syscal descriptor to program
+ * @fg_handle: the flow group the request is charged to
+ * @lba: the first block to deallocate
+ * @lba_count: number of blocks
+ * @cookie: a user-level tag for the request
+ */
+static inline void
+ksys_nvme_trim(struct bsys_desc *d, hqu_t fg_handle, unsigned long lba,
+	       unsigned int lba_count, unsigned long cookie)
+{
+	BSYS_DESC_4ARG(d, KSYS_NVME_TRIM, fg_handle, lba, lba_count, cookie);
+}
+
+/* ksys_nvme_write_zeroes - zeroes a range of blocks without a data transfer
+ * @d: the syscal descriptor to program
+ * @fg_handle: the flow group the request is charged to
+ * @lba: the first block to zero
+ * @lba_count: number of blocks (at most 65536)
+ * @cookie: a user-level tag for the request
  */
 static inline void
-ksys_nvme_unregister_flow(struct bsys_desc *d, long fg_handle)
+ksys_nvme_write_zeroes(struct bsys_desc *d, hqu_t fg_handle, unsigned long lba,
+		       unsigned int lba_count, unsigned long cookie)
 {
-	BSYS_DESC_1ARG(d, KSYS_NVME_UNREGISTER_FLOW, fg_handle);
+	BSYS_DESC_4ARG(d, KSYS_NVME_WRITE_ZEROES, fg_handle, lba, lba_count, cookie);
+}
+
+/* ksys_nvme_flush - commits the device's volatile write cache
+ * @d: the syscal descriptor to program
+ * @fg_handle: the flow group the request is charged to
+ * @cookie: a user-level tag for the request
+ */
+static inline void
+ksys_nvme_flush(struct bsys_desc *d, hqu_t fg_handle, unsigned long cookie)
+{
+	BSYS_DESC_2ARG(d, KSYS_NVME_FLUSH, fg_handle, cookie);
 }
 
 
@@ -504,13 +565,30 @@ enum {
 	USYS_NVME_REGISTERED_FLOW,
 	USYS_NVME_UNREGISTERED_FLOW,
 	USYS_TIMER,
+	USYS_NVME_COMPLETIONS,
 	USYS_NR,
 };
 
+/*
+ * USYS_NVME_COMPLETIONS carries a vector of NVMe completions, each of which
+ * would otherwise be a USYS_NVME_RESPONSE or USYS_NVME_WRITTEN event.
+ */
+struct nvme_cpl_ent {
+	uint64_t sysnr;		/* USYS_NVME_RESPONSE or USYS_NVME_WRITTEN */
+	uint64_t cookie;
+	uint64_t buf;		/* the read buffer (responses only) */
+	int64_t ret;
+};
+
+#define USYS_NVME_CPL_MAX	2048	/* completions per vector */
+
 #ifdef __KERNEL__
 
 DECLARE_PERCPU(struct bsys_arr *, usys_arr);
 DECLARE_PERCPU(unsigned long, syscall_cookie);
+DECLARE_PERCPU(struct nvme_cpl_ent *, usys_nvme_cpl);
+DECLARE_PERCPU(struct nvme_cpl_ent *, usys_nvme_cpl_user);
+DECLARE_PERCPU(struct bsys_desc *, usys_nvme_cpl_desc);
 
 /**
  * usys_reset - reset the batched call array
@@ -520,6 +598,7 @@ DECLARE_PERCPU(unsigned long, syscall_cookie);
 static inline void usys_reset(void)
 {
 	percpu_get(usys_arr)->len = 0;
+	percpu_get(usys_nvme_cpl_desc) = NULL;
 }
 
 /**
@@ -712,6 +791,41 @@ usys_nvme_unregistered_flow(long flow_group_id, long ret)
 	BSYS_DESC_2ARG(d, USYS_NVME_UNREGISTERED_FLOW, flow_group_id, ret);
 }
 
+/**
+ * usys_nvme_completion - adds an NVMe completion to this batch's
+ * USYS_NVME_COMPLETIONS event
+ * @sysnr: USYS_NVME_RESPONSE or USYS_NVME_WRITTEN
+ * @cookie: a user-level tag for the flow
+ * @buf: the read buffer (responses only)
+ * @ret: return status of the command
+ *
+ * Falls back to a single event once the vector is full.
+ */
+static inline void
+usys_nvme_completion(unsigned long sysnr, unsigned long cookie, void *buf, long ret)
+{
+	struct bsys_desc *d = percpu_get(usys_nvme_cpl_desc);
+	struct nvme_cpl_ent *e;
+
+	if (!d) {
+		d = usys_next();
+		BSYS_DESC_2ARG(d, USYS_NVME_COMPLETIONS, percpu_get(usys_nvme_cpl_user), 0);
+		percpu_get(usys_nvme_cpl_desc) = d;
+	} else if (d->argb == USYS_NVME_CPL_MAX) {
+		if (sysnr == USYS_NVME_RESPONSE)
+			usys_nvme_response(cookie, buf, ret);
+		else
+			usys_nvme_written(cookie, ret);
+		return;
+	}
+
+	e = &percpu_get(usys_nvme_cpl)[d->argb++];
+	e->sysnr = sysnr;
+	e->cookie = cookie;
+	e->buf = (uint64_t) buf;
+	e->ret = ret;
+}
+
 /*
  * usys_timer - indicates that there is a timer event
  */
@@ -752,8 +866,9 @@ extern long bsys_nvme_open(long dev_id, long ns_id);
 extern long bsys_nvme_close(long dev_id, long ns_id, hqu_t handle);
 extern long bsys_nvme_register_flow(long flow_group_id, unsigned long cookie, 
 				unsigned int latency_us_SLO, unsigned long IOPS_SLO, 
-				int rw_ratio_SLO);
-extern long bsys_nvme_unregister_flow(long flow_group_id); 
+				unsigned long rw_ratio_be_weight, hid_t handle);
+extern long bsys_nvme_unregister_flow(long flow_group_id, hid_t handle); 
+extern long bsys_nvme_register_buf(void *addr, unsigned long len);
 extern long bsys_nvme_write(hqu_t priority, void *buf, unsigned long lba,
 			    unsigned int lba_count, unsigned long cookie);
 extern long bsys_nvme_read(hqu_t priority, void * buf, unsigned long lba,
@@ -763,6 +878,11 @@ extern long bsys_nvme_writev(hqu_t fg_handle, void **sgls, int num_sgls,
 
 extern long bsys_nvme_readv(hqu_t fg_handle, void **sgls, int num_sgls,
 			    unsigned long lba, unsigned int lba_count, unsigned long cookie);
+extern long bsys_nvme_trim(hqu_t fg_handle, unsigned long lba, unsigned int lba_count,
+			   unsigned long cookie);
+extern long bsys_nvme_write_zeroes(hqu_t fg_handle, unsigned long lba,
+				   unsigned int lba_count, unsigned long cookie);
+extern long bsys_nvme_flush(hqu_t fg_handle, unsigned long cookie);
   
 struct dune_tf;
 extern void do_syscall(struct dune_tf *tf, uint64_t sysnr);
@@ -77,6 +77,8 @@ struct ix_ops {
 	void (*nvme_registered_flow)   (long flow_group_id, unsigned long cookie, long ret);
 	void (*nvme_unregistered_flow)     (long flow_group_id, long ret);
 	void (*timer_event)(unsigned long cookie);
+	/* optional, by default each completion goes to nvme_response/nvme_written */
+	void (*nvme_completions)(struct nvme_cpl_ent *ents, unsigned long nr);
 };
 
 extern void ix_flush(void);
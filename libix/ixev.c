@@ -269,6 +269,18 @@ static void ixev_nvme_response(unsigned long cookie, void *buf, long ret){
 
 }
 
+static void ixev_nvme_completions(struct nvme_cpl_ent *ents, unsigned long nr)
+{
+	unsigned long i;
+
+	for (i = 0; i < nr; i++) {
+		if (ents[i].sysnr == USYS_NVME_RESPONSE)
+			ixev_nvme_response(ents[i].cookie, (void *) ents[i].buf, ents[i].ret);
+		else
+			ixev_nvme_written(ents[i].cookie, ents[i].ret);
+	}
+}
+
 static void ixev_nvme_opened(hqu_t handle, unsigned long ns_size, unsigned long ns_sector_size){
 
 	if (ns_size == 0){
@@ -330,6 +342,7 @@ static struct ix_ops ixev_ops = {
 	.nvme_registered_flow = ixev_nvme_registered_flow,
 	.nvme_unregistered_flow = ixev_nvme_unregistered_flow,
 	.timer_event	= ixev_timer_event,
+	.nvme_completions = ixev_nvme_completions,
 };
 
 /**
@@ -538,6 +551,17 @@ ssize_t ixev_send_zc(struct ixev_ctx *ctx, void *addr, size_t len)
 		return -EIO;
 	if (!actual_len)
 		return -EAGAIN;
+
+	/* data that continues the previous zero-copy entry extends it */
+	if (ctx->send_count && !ctx->cur_buf) {
+		ent = &ctx->send[ctx->send_count - 1];
+		if ((char *) ent->base + ent->len == (char *) addr) {
+			ent->len += actual_len;
+			ixev_update_send_stats(ctx, actual_len);
+			return actual_len;
+		}
+	}
+
 	if (ctx->send_count >= IXEV_SEND_DEPTH)
 		return -EAGAIN;
 
@@ -640,7 +664,7 @@ void ixev_nvme_writev(hqu_t fg_handle, void **sgls,
 
 
 void ixev_nvme_register_flow(long flow_group_id, unsigned long cookie, unsigned int latency_us_SLO,
-							 unsigned long IOPS_SLO, int rw_ratio_SLO)
+							 unsigned long IOPS_SLO, int rw_ratio_SLO, unsigned int be_weight)
 {
 	if (unlikely(karr->len >= karr->max_len)) {
 		printf("ixev: ran out of command space 4\n");
@@ -648,22 +672,78 @@ void ixev_nvme_register_flow(long flow_group_id, unsigned long cookie, unsigned
 	}
 //	printf("IXEV: rw_ratio_SLO is %f\n", rw_ratio_SLO);
 	ksys_nvme_register_flow(__bsys_arr_next(karr), flow_group_id, cookie, 
-							latency_us_SLO, IOPS_SLO, rw_ratio_SLO);
+							latency_us_SLO, IOPS_SLO, rw_ratio_SLO, be_weight,
+							((struct ixev_ctx *) cookie)->handle);
 
 }
 
 
-void ixev_nvme_unregister_flow(long flow_group_id)
+void ixev_nvme_unregister_flow(long flow_group_id, unsigned long cookie)
 {
 	if (unlikely(karr->len >= karr->max_len)) {
 		printf("ixev: ran out of command space 5\n");
 		exit(-1);
 	}
 
-	ksys_nvme_unregister_flow(__bsys_arr_next(karr), flow_group_id);
+	ksys_nvme_unregister_flow(__bsys_arr_next(karr), flow_group_id,
+				  ((struct ixev_ctx *) cookie)->handle);
 
 }
 
+/**
+ * ixev_nvme_register_buf - pre-translates a buffer pool used for NVMe I/O
+ * @addr: the start of the pool (2MB aligned, e.g. a mempool datastore)
+ * @len: the length of the pool in bytes
+ *
+ * Optional: I/O on unregistered buffers still works, but each 4KB SGL
+ * element then costs a page table walk in the dataplane.
+ */
+void ixev_nvme_register_buf(void *addr, unsigned long len)
+{
+	if (unlikely(karr->len >= karr->max_len)) {
+		printf("ixev: ran out of command space 6\n");
+		exit(-1);
+	}
+
+	ksys_nvme_register_buf(__bsys_arr_next(karr), addr, len);
+}
+
+/*
+ * Trim, write zeroes and flush complete like writes (a USYS_NVME_WRITTEN
+ * event with @cookie), as they have no data to return.
+ */
+void ixev_nvme_trim(hqu_t fg_handle, unsigned long lba,
+		    unsigned int lba_count, unsigned long cookie)
+{
+	if (unlikely(karr->len >= karr->max_len)) {
+		printf("ixev: ran out of command space 7\n");
+		exit(-1);
+	}
+
+	ksys_nvme_trim(__bsys_arr_next(karr), fg_handle, lba, lba_count, cookie);
+}
+
+void ixev_nvme_write_zeroes(hqu_t fg_handle, unsigned long lba,
+			    unsigned int lba_count, unsigned long cookie)
+{
+	if (unlikely(karr->len >= karr->max_len)) {
+		printf("ixev: ran out of command space 7\n");
+		exit(-1);
+	}
+
+	ksys_nvme_write_zeroes(__bsys_arr_next(karr), fg_handle, lba, lba_count, cookie);
+}
+
+void ixev_nvme_flush(hqu_t fg_handle, unsigned long cookie)
+{
+	if (unlikely(karr->len >= karr->max_len)) {
+		printf("ixev: ran out of command space 7\n");
+		exit(-1);
+	}
+
+	ksys_nvme_flush(__bsys_arr_next(karr), fg_handle, cookie);
+}
+
 /**
  * ixev_ctx_init - prepares a context for use
  * @ctx: the context
@@ -811,6 +891,18 @@ static void ixev_handle_nvme_unregister_flow_ret(struct ixev_ctx *ctx, long ret)
 	}
 }
 
+static void ixev_handle_nvme_register_buf_ret(long ret)
+{
+	if (unlikely(ret != 0))
+		printf("ixev: failed to register nvme buffer pool, ret = %ld\n", ret);
+}
+
+static void ixev_handle_nvme_nodata_ret(long ret)
+{
+	if (unlikely(ret != 0))
+		printf("ixev: failed to trim, zero or flush nvme, ret = %ld\n", ret);
+}
+
 static void ixev_handle_one_ret(struct bsys_ret *r)
 {
 	struct ixev_ctx *ctx = (struct ixev_ctx *) r->cookie;
@@ -859,6 +951,16 @@ static void ixev_handle_one_ret(struct bsys_ret *r)
 	case KSYS_NVME_UNREGISTER_FLOW:
 		ixev_handle_nvme_unregister_flow_ret(ctx, ret);
 		break;
+
+	case KSYS_NVME_REGISTER_BUF:
+		ixev_handle_nvme_register_buf_ret(ret);
+		break;
+
+	case KSYS_NVME_TRIM:
+	case KSYS_NVME_WRITE_ZEROES:
+	case KSYS_NVME_FLUSH:
+		ixev_handle_nvme_nodata_ret(ret);
+		break;
 	
 	default:
 		if (unlikely(ret))
@@ -202,8 +202,14 @@ extern void ixev_nvme_writev(hqu_t fg_handle, void **sgls,
 			     unsigned long cookie);
 
 extern void ixev_nvme_register_flow(long flow_group_id, unsigned long cookie, unsigned int latency_us_SLO,
-							 unsigned long IOPS_SLO, int rw_ratio_SLO);
-extern void ixev_nvme_unregister_flow(long flow_group_id); 
+							 unsigned long IOPS_SLO, int rw_ratio_SLO, unsigned int be_weight);
+extern void ixev_nvme_unregister_flow(long flow_group_id, unsigned long cookie); 
+extern void ixev_nvme_register_buf(void *addr, unsigned long len);
+extern void ixev_nvme_trim(hqu_t fg_handle, unsigned long lba,
+			   unsigned int lba_count, unsigned long cookie);
+extern void ixev_nvme_write_zeroes(hqu_t fg_handle, unsigned long lba,
+				   unsigned int lba_count, unsigned long cookie);
+extern void ixev_nvme_flush(hqu_t fg_handle, unsigned long cookie);
 
 
 /**
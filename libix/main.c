@@ -121,6 +121,21 @@ ix_default_tcp_knock(int handle, struct ip_tuple *id)
 	ix_tcp_reject(handle);
 }
 
+static void
+ix_default_nvme_completions(struct nvme_cpl_ent *ents, unsigned long nr)
+{
+	unsigned long i;
+
+	for (i = 0; i < nr; i++) {
+		if (ents[i].sysnr == USYS_NVME_RESPONSE)
+			usys_tbl[USYS_NVME_RESPONSE](ents[i].cookie, ents[i].buf,
+						     ents[i].ret, 0, 0, 0);
+		else
+			usys_tbl[USYS_NVME_WRITTEN](ents[i].cookie, ents[i].ret,
+						    0, 0, 0, 0);
+	}
+}
+
 /**
  * ix_init - initializes libIX
  * @ops: user-provided event handlers
@@ -147,12 +162,15 @@ int ix_init(struct ix_ops *ops, int batch_depth)
 	usys_tbl[USYS_NVME_REGISTERED_FLOW]    = (bsysfn_t) ops->nvme_registered_flow;
 	usys_tbl[USYS_NVME_UNREGISTERED_FLOW]  = (bsysfn_t) ops->nvme_unregistered_flow;
 	usys_tbl[USYS_TIMER]    	       = (bsysfn_t) ops->timer_event;
+	usys_tbl[USYS_NVME_COMPLETIONS]        = (bsysfn_t) ops->nvme_completions;
 
 	/* provide sane defaults so we don't leak memory */
 	if (!ops->udp_recv)
 		usys_tbl[USYS_UDP_RECV] = (bsysfn_t) ix_default_udp_recv;
 	if (!ops->tcp_knock)
 		usys_tbl[USYS_TCP_KNOCK] = (bsysfn_t) ix_default_tcp_knock;
+	if (!ops->nvme_completions)
+		usys_tbl[USYS_NVME_COMPLETIONS] = (bsysfn_t) ix_default_nvme_completions;
 
 	uarr = sys_baddr();
 	if (!uarr)
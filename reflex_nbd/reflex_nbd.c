@@ -127,6 +127,60 @@ static void reflex_end_request(struct reflex_queue *fq, struct request *req)
 	blk_mq_end_request(req, error);
 }
 
+static inline unsigned int reflex_rq_pages(struct request *req)
+{
+	/* discards and flushes carry no data */
+	if (req->cmd_flags & (REQ_DISCARD | REQ_FLUSH))
+		return 0;
+	return DIV_ROUND_UP(blk_rq_bytes(req), REFLEX_CREDIT_PAGE_SIZE);
+}
+
+/*
+ * Take room for req in the server's window. If there is none, the hw queue
+ * is stopped and restarted by reflex_put_credit() once a response arrives.
+ */
+static bool reflex_get_credit(struct reflex_queue *fq, struct request *req)
+{
+	unsigned int pages = reflex_rq_pages(req);
+	unsigned long flags;
+	bool ok;
+
+	spin_lock_irqsave(&fq->credit_lock, flags);
+	ok = !fq->out_reqs || (fq->out_reqs < fq->credit_reqs &&
+			       fq->out_pages + pages <= fq->credit_pages);
+	if (ok) {
+		fq->out_reqs++;
+		fq->out_pages += pages;
+	} else {
+		fq->stalled = true;
+		blk_mq_stop_hw_queue(fq->hctx);
+	}
+	spin_unlock_irqrestore(&fq->credit_lock, flags);
+
+	return ok;
+}
+
+static void reflex_put_credit(struct reflex_queue *fq, struct request *req,
+			      binary_header_blk_t *header)
+{
+	unsigned long flags;
+	bool restart;
+
+	spin_lock_irqsave(&fq->credit_lock, flags);
+	fq->out_reqs--;
+	fq->out_pages -= reflex_rq_pages(req);
+	if (header->credit_reqs) {
+		fq->credit_reqs = header->credit_reqs;
+		fq->credit_pages = header->credit_pages;
+	}
+	restart = fq->stalled;
+	fq->stalled = false;
+	spin_unlock_irqrestore(&fq->credit_lock, flags);
+
+	if (restart)
+		blk_mq_start_stopped_hw_queue(fq->hctx, true);
+}
+
 /*
  *  Send or receive packet.
  */
@@ -215,18 +269,32 @@ static int reflex_send_req(struct reflex_queue *fq, struct request *req)
 	struct bio *bio;
 	int num_bio = 0;
 	
-	if(unlikely((req->cmd_type != REFLEX_CMD_WRITE) && (req->cmd_type != REFLEX_CMD_READ))) {
-		printk("Unsupported command received %s\n", nbdcmd_to_ascii(req->cmd_type));
-		goto error_out;
-	}
-	
 	header.lba = blk_rq_pos(req);
 	//FIXME: Shift value must correspond with reflex server sector size
 	header.lba_count = blk_rq_bytes(req) >> 9; 
 	header.magic = sizeof(binary_header_blk_t);
-	header.opcode = (req->cmd_type == REFLEX_CMD_WRITE) ? CMD_SET : CMD_GET;
-	BUG_ON((req->cmd_type != REFLEX_CMD_WRITE) && (req->cmd_type != REFLEX_CMD_READ));
+	switch (cmd_type) {
+	case REFLEX_CMD_READ:
+		header.opcode = CMD_GET;
+		break;
+	case REFLEX_CMD_WRITE:
+		header.opcode = CMD_SET;
+		break;
+	case REFLEX_CMD_TRIM:
+		header.opcode = CMD_TRIM;
+		break;
+	case REFLEX_CMD_FLUSH:
+		header.opcode = CMD_FLUSH;
+		header.lba = 0;
+		header.lba_count = 0;
+		break;
+	default:
+		printk("Unsupported command received %s\n", nbdcmd_to_ascii(cmd_type));
+		goto error_out;
+	}
 	header.req_handle = req;
+	header.credit_reqs = 0;
+	header.credit_pages = 0;
 
 	result = sock_xmit(sock, 1, &header, sizeof(binary_header_blk_t),
 			   (cmd_type == REFLEX_CMD_WRITE) ? MSG_MORE : 0); 
@@ -314,6 +382,7 @@ static int reflex_read_stat(struct reflex_queue *fq)
 				}
 			}
 		}
+		reflex_put_credit(fq, req, &header);
 		reflex_end_request(fq, req);
 	}
 
@@ -348,9 +417,6 @@ static void reflex_handle_cmd(struct reflex_queue *fq, struct reflex_cmd *cmd)
 
 	}
 
-	BUG_ON(req->cmd_flags & REQ_FLUSH);
-	BUG_ON(req->cmd_flags & REQ_FLUSH_SEQ);
-	BUG_ON(req->cmd_flags & REQ_DISCARD);
 	BUG_ON(req->cmd_flags & REQ_SOFTBARRIER);
 	BUG_ON(req->cmd_flags & REQ_STARTED);
 	
@@ -397,6 +463,9 @@ static int reflex_queue_rq(struct blk_mq_hw_ctx *hctx,
 	struct reflex_cmd *cmd = blk_mq_rq_to_pdu(bd->rq);
 	struct reflex_queue *fq = hctx->driver_data;
 		
+	if (!reflex_get_credit(fq, bd->rq))
+		return BLK_MQ_RQ_QUEUE_BUSY;
+
 	blk_mq_start_request(bd->rq);
 	reflex_handle_cmd(fq, cmd);
 	  
@@ -423,6 +492,14 @@ static int reflex_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
 	
 	mutex_init(&fq->tx_lock);
 	hctx->driver_data = fq;
+	fq->hctx = hctx;
+
+	spin_lock_init(&fq->credit_lock);
+	fq->out_reqs = 0;
+	fq->out_pages = 0;
+	fq->credit_reqs = REFLEX_INIT_CREDIT_REQS;
+	fq->credit_pages = REFLEX_INIT_CREDIT_PAGES;
+	fq->stalled = false;
 	fq->reflex_reqs = kzalloc(sizeof(long) * hw_queue_depth, GFP_KERNEL);
 
 	/* Connect to reflex server */
@@ -573,6 +650,10 @@ static int __init reflex_init(void)
 	blk_queue_max_segments(reflex_dev->q, 8);
 	blk_queue_max_integrity_segments(reflex_dev->q, 1);
 	blk_queue_max_discard_sectors(reflex_dev->q, 0xffffffff);
+	reflex_dev->q->limits.discard_granularity = 512;
+	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, reflex_dev->q);
+	/* the server has a volatile write cache to flush, but no FUA */
+	blk_queue_flush(reflex_dev->q, REQ_FLUSH);
 		
 	disk = reflex_dev->disk = alloc_disk_node(1, home_node);
 	if (!disk) {
@@ -70,6 +70,15 @@ struct reflex_queue {
 	struct reflex_device *reflex_dev;
 	struct socket *sock;
 	struct task_struct *recvthread;
+	struct blk_mq_hw_ctx *hctx;
+
+	/* flow control window advertised by the server */
+	spinlock_t credit_lock;
+	unsigned int out_reqs;
+	unsigned int out_pages;
+	unsigned int credit_reqs;
+	unsigned int credit_pages;
+	bool stalled;		/* hctx stopped until credits come back */
 };
 
 struct reflex_device {